@@ -0,0 +1,29 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <cstring>
+
+std::string_view Arena::copy(std::string_view s) {
+  if (s.empty()) {
+    return {};
+  }
+  while (current < blocks.size()
+         && blocks[current].capacity - used < s.size()) {
+    ++current;
+    used = 0;
+  }
+  if (current == blocks.size()) {
+    const auto capacity = std::max(BLOCK_SIZE, s.size());
+    blocks.emplace_back(std::make_unique_for_overwrite<char[]>(capacity),
+                        capacity);
+  }
+  auto dst = blocks[current].data.get() + used;
+  std::memcpy(dst, s.data(), s.size());
+  used += s.size();
+  return std::string_view(dst, s.size());
+}
+
+void Arena::clear() noexcept {
+  current = 0;
+  used = 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Copies strings into blocks that stay put until clear(), for text that has
+// to outlive the buffer it came from.
+class Arena {
+ public:
+  static constexpr size_t BLOCK_SIZE = 64uz << 10;
+
+  std::string_view copy(std::string_view s);
+
+  // Forgets everything copied so far.  Keeps the blocks for reuse, so that
+  // a worker that's warmed up doesn't allocate.
+  void clear() noexcept;
+
+ private:
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t capacity;
+  };
+
+  std::vector<Block> blocks;
+  // The block being filled, and how much of it is.
+  size_t current = 0;
+  size_t used = 0;
+};
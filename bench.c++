@@ -0,0 +1,575 @@
+// Benchmarks for gr.  `make bench` builds gr and runs them all; `gr-bench
+// NAME...` runs just the ones whose names contain one of the NAMEs.
+//
+// First it checks that ./gr finds what it should on a few small trees, for
+// bugs where a wrong answer would only look like a faster run.  The micro
+// benchmarks time the pieces that run per line or per file.  The
+// end-to-end ones write synthetic trees to a temporary directory, time
+// ./gr (or $GR) over each, and time reading and scanning each file on its
+// own for the per-file latencies.
+
+#include <absl/strings/string_view.h>
+#include <fcntl.h>
+#include <re2/re2.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "circle_queue.h"
+#include "file.h"
+#include "job.h"
+#include "text.h"
+
+extern char** environ;
+
+struct Scratch {};
+
+namespace {
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+// How long each micro benchmark runs for, at least.
+constexpr std::chrono::milliseconds MIN_TIME{200};
+// How long a run of gr may take before it's taken to have hung.
+constexpr std::chrono::seconds GR_TIMEOUT{60};
+
+std::vector<std::string_view> filters;
+
+bool wanted(std::string_view name) {
+  return filters.empty()
+      || std::ranges::any_of(filters, [&](auto f) {
+           return name.contains(f);
+         });
+}
+
+template <typename T>
+void keep(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+double seconds(Clock::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+// Runs op until MIN_TIME has passed, doubling the count between checks, and
+// reports the time per call along with the rate of whatever each call does
+// `bytes` or `items` of.
+template <typename F>
+void micro(std::string_view name, size_t bytes, size_t items, F&& op) {
+  if (!wanted(name)) {
+    return;
+  }
+  op();
+  size_t n = 1;
+  Clock::duration took;
+  while (true) {
+    const auto start = Clock::now();
+    for (auto i = 0uz; i < n; ++i) {
+      op();
+    }
+    took = Clock::now() - start;
+    if (took >= MIN_TIME) {
+      break;
+    }
+    n *= 2;
+  }
+  const auto per = seconds(took) / n;
+  std::string rate;
+  if (bytes) {
+    rate += std::format("  {:8.3f} GB/s", bytes / per / 1e9);
+  }
+  if (items) {
+    rate += std::format("  {:8.2f} M/s", items / per / 1e6);
+  }
+  std::cout << std::format("{:<36} {:12.1f} ns{}\n", name, per * 1e9, rate);
+}
+
+std::string text_lines(size_t size, std::mt19937_64& rng) {
+  static constexpr std::string_view words[] = {
+    "alpha", "beta", "gamma", "delta", "epsilon", "zeta", "eta", "theta",
+    "iota", "kappa", "lambda", "mu", "nu", "xi", "omicron", "pi",
+  };
+  std::string s;
+  while (s.size() < size) {
+    const auto n = 4 + rng() % 12;
+    for (auto i = 0uz; i < n; ++i) {
+      s += words[rng() % std::size(words)];
+      s += i + 1 == n ? '\n' : ' ';
+    }
+    if (rng() % 1000 == 0) {
+      s += std::format("needle{}\n", rng() % 100);
+    }
+  }
+  return s;
+}
+
+class FanOut : public Job {
+ public:
+  FanOut(WorkQueue& queue, int depth): queue(queue), depth(depth) {}
+
+  void operator()(Scratch&) override {
+    if (depth) {
+      for (int i = 0; i < FANOUT; ++i) {
+        queue.push(std::make_unique<FanOut>(queue, depth - 1));
+      }
+    }
+  }
+
+  static constexpr int FANOUT = 8;
+
+ private:
+  WorkQueue& queue;
+  const int depth;
+};
+
+class Nop : public Job {
+ public:
+  void operator()(Scratch&) override {}
+};
+
+void run_workers(WorkQueue& queue, size_t threads) {
+  std::vector<std::thread> ts;
+  for (auto i = 0uz; i < threads; ++i) {
+    ts.emplace_back([&queue, i] {
+      Scratch scratch;
+      queue.runUntilEmpty(i, scratch);
+    });
+  }
+  for (auto& t: ts) {
+    t.join();
+  }
+}
+
+void micro_benchmarks() {
+  std::mt19937_64 rng(1);
+  const auto text = text_lines(4uz << 20, rng);
+
+  const auto head = std::string_view(text).substr(0, BINARY_HEAD);
+  micro("is_binary/text", head.size(), 0, [&] {
+    keep(is_binary(head));
+  });
+  auto bin = std::string(head);
+  bin.back() = '\0';
+  micro("is_binary/nul_at_end", bin.size(), 0, [&] {
+    keep(is_binary(bin));
+  });
+
+  std::string long_line;
+  while (long_line.size() < 8192) {
+    long_line += "h\xc3\xa9llo w\xc3\xb6rld ";
+  }
+  micro("truncate_span/short", 0, 1, [&] {
+    keep(truncate_span(long_line, 80, false));
+  });
+  micro("truncate_span/long", 0, 1, [&] {
+    keep(truncate_span(long_line, long_line.size(), false));
+  });
+
+  CircleQueue<std::pair<std::string_view, bool>> context(8);
+  const std::string_view line = "alpha beta gamma";
+  micro("circle_queue/emplace", 0, 1, [&] {
+    context.emplace(line, false);
+  });
+
+  auto counts = std::vector<size_t>{1, 2, 4};
+  counts.push_back(std::max(1u, std::thread::hardware_concurrency()));
+  std::ranges::sort(counts);
+  counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+  for (const auto threads: counts) {
+    // 1 + 8 + ... + 8^5 jobs, each pushed by a worker.
+    constexpr size_t tree = 37449;
+    micro(std::format("work_queue/fan_out/{}", threads), 0, tree, [&] {
+      WorkQueue queue(threads);
+      queue.push(std::make_unique<FanOut>(queue, 5));
+      run_workers(queue, threads);
+    });
+    constexpr size_t injected = 10000;
+    micro(std::format("work_queue/injected/{}", threads), 0, injected, [&] {
+      WorkQueue queue(threads);
+      for (auto i = 0uz; i < injected; ++i) {
+        queue.push(std::make_unique<Nop>());
+      }
+      run_workers(queue, threads);
+    });
+  }
+
+  const RE2 re("needle\\d+");
+  RE2::Options scan_options;
+  scan_options.set_never_nl(true);
+  const RE2 scan("(?m)needle\\d+", scan_options);
+  micro("match/per_line", text.size(), 0, [&] {
+    size_t hits = 0;
+    const std::string_view view = text;
+    for (size_t pos = 0; pos < view.size(); ) {
+      const auto eol = view.find('\n', pos);
+      hits += RE2::PartialMatch(
+          absl::string_view(view.data() + pos, eol - pos), re);
+      pos = eol + 1;
+    }
+    keep(hits);
+  });
+  micro("match/whole_buffer", text.size(), 0, [&] {
+    size_t hits = 0;
+    const absl::string_view view(text.data(), text.size());
+    absl::string_view m;
+    for (size_t pos = 0;
+         scan.Match(view, pos, view.size(), RE2::UNANCHORED, &m, 1);
+         pos = m.data() + m.size() - view.data()) {
+      ++hits;
+    }
+    keep(hits);
+  });
+}
+
+struct Corpus {
+  std::string name;
+  std::string pattern;
+  // What gr is run with, besides the pattern and the tree.
+  std::vector<std::string> args = {"-c"};
+  std::vector<fs::path> files;
+  size_t bytes = 0;
+};
+
+void write_file(Corpus& corpus, const fs::path& path, std::string_view s) {
+  fs::create_directories(path.parent_path());
+  std::ofstream(path, std::ios::binary).write(s.data(), s.size());
+  corpus.files.push_back(path);
+  corpus.bytes += s.size();
+}
+
+// The synthetic trees, each written to a directory by its make.
+struct CorpusSpec {
+  const char* name;
+  void (*make)(Corpus& corpus, const fs::path& dir, std::mt19937_64& rng);
+};
+
+constexpr CorpusSpec CORPORA[] = {
+  {"many_tiny_files", [](Corpus& c, const fs::path& dir, auto& rng) {
+     for (auto i = 0uz; i < 20000; ++i) {
+       const auto path = std::format("d{}/f{}.txt", i % 200, i);
+       write_file(c, dir / path, text_lines(200, rng));
+     }
+   }},
+  {"one_huge_file", [](Corpus& c, const fs::path& dir, auto& rng) {
+     write_file(c, dir / "huge.txt", text_lines(256uz << 20, rng));
+   }},
+  {"long_lines", [](Corpus& c, const fs::path& dir, auto& rng) {
+     for (auto i = 0uz; i < 200; ++i) {
+       auto s = text_lines(256uz << 10, rng);
+       std::ranges::replace(s, '\n', ' ');
+       write_file(c, dir / std::format("f{}.txt", i), s);
+     }
+   }},
+  {"binary_heavy", [](Corpus& c, const fs::path& dir, auto& rng) {
+     // Nine in ten have a NUL near the start.
+     for (auto i = 0uz; i < 2000; ++i) {
+       auto s = text_lines(64uz << 10, rng);
+       if (i % 10) {
+         for (auto j = 0uz; j < s.size(); j += 97) {
+           s[j] = static_cast<char>(rng());
+         }
+         s[rng() % 256] = '\0';
+       }
+       write_file(c, dir / std::format("f{}.bin", i), s);
+     }
+   }},
+  {"one_small_file", [](Corpus& c, const fs::path& dir, auto& rng) {
+     // All startup.
+     write_file(c, dir / "small.txt", text_lines(4uz << 10, rng));
+   }},
+  {"sort_backpressure", [](Corpus& c, const fs::path& dir, auto& rng) {
+     // Nearly every line matches, for about 4 times the 32 MiB --sort may
+     // hold before workers wait on the files before theirs: it has to
+     // finish anyway.
+     c.pattern = "a";
+     c.args = {"--sort=path", "-j", "4"};
+     for (auto i = 0uz; i < 128; ++i) {
+       write_file(c, dir / std::format("f{:03}.txt", i),
+                  text_lines(1uz << 20, rng));
+     }
+   }},
+};
+
+// Runs gr with args, its output going to out, and returns its exit status
+// and how long it took.  Throws if it can't be run, is killed, or takes
+// longer than GR_TIMEOUT.
+std::pair<int, Clock::duration> spawn_gr(const std::string& gr,
+                                         const std::vector<std::string>& args,
+                                         const std::string& out) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out.c_str(),
+                                   O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  std::vector<const char*> argv = {gr.c_str()};
+  for (const auto& arg: args) {
+    argv.push_back(arg.c_str());
+  }
+  argv.push_back(nullptr);
+  const auto start = Clock::now();
+  pid_t pid;
+  const auto err = posix_spawn(&pid, gr.c_str(), &actions, nullptr,
+                               const_cast<char**>(argv.data()), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err) {
+    throw std::system_error(err, std::generic_category(), gr);
+  }
+  std::mutex m;
+  std::condition_variable cv;
+  bool exited = false;
+  bool killed = false;
+  std::thread watchdog([&] {
+    std::unique_lock lk(m);
+    if (!cv.wait_for(lk, GR_TIMEOUT, [&] { return exited; })) {
+      kill(pid, SIGKILL);
+      killed = true;
+    }
+  });
+  int status;
+  waitpid(pid, &status, 0);
+  const auto took = Clock::now() - start;
+  {
+    std::lock_guard lk(m);
+    exited = true;
+  }
+  cv.notify_one();
+  watchdog.join();
+  if (killed) {
+    throw std::runtime_error(std::format("{} hung", gr));
+  }
+  if (!WIFEXITED(status)) {
+    throw std::runtime_error(std::format("{} crashed", gr));
+  }
+  return {WEXITSTATUS(status), took};
+}
+
+// Runs gr over dir with its output thrown away, and returns how long it
+// took.
+Clock::duration run_gr(const std::string& gr, const Corpus& corpus,
+                       const fs::path& dir) {
+  auto args = corpus.args;
+  args.push_back(corpus.pattern);
+  args.push_back(dir.string());
+  const auto [status, took] = spawn_gr(gr, args, "/dev/null");
+  if (status > 1) {
+    throw std::runtime_error(std::format("{} failed on {}", gr,
+                                         dir.string()));
+  }
+  return took;
+}
+
+// A directory of its own under the temporary directory, removed along with
+// everything in it at the end.
+struct TempDir {
+  TempDir() {
+    auto tmpl = (fs::temp_directory_path() / "gr-bench.XXXXXX").string();
+    if (!mkdtemp(tmpl.data())) {
+      throw std::system_error(errno, std::generic_category(), "mkdtemp");
+    }
+    path = tmpl;
+  }
+
+  ~TempDir() {
+    std::error_code ec;
+    fs::remove_all(path, ec);
+  }
+
+  TempDir(const TempDir&) = delete;
+  TempDir& operator=(const TempDir&) = delete;
+
+  fs::path path;
+};
+
+// Runs gr over a check's directory, which the check fills first.
+class Checker {
+ public:
+  Checker(const std::string& gr, std::string_view name, const fs::path& root)
+      : gr(gr), name(name), dir(root / name), out((root / "out").string()) {
+    fs::create_directories(dir);
+  }
+
+  void write(std::string_view file, std::string_view s) const {
+    std::ofstream(dir / file, std::ios::binary).write(s.data(), s.size());
+  }
+
+  // A path outside the directory, for what gr writes.
+  std::string scratch(std::string_view file) const {
+    return (dir.parent_path() / std::format("{}.{}", name, file)).string();
+  }
+
+  // Runs gr with args and then the directory, and returns what it printed.
+  std::string run(std::vector<std::string> args) const {
+    args.push_back(dir.string());
+    if (spawn_gr(gr, args, out).first > 1) {
+      throw std::runtime_error(std::format("check/{}: {} failed", name, gr));
+    }
+    std::ifstream in(out, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), {});
+  }
+
+  // Throws unless gr -l with args lists just these of the directory's files.
+  void expect(std::vector<std::string> args,
+              std::vector<std::string> files) const {
+    args.insert(args.begin(), "-l");
+    const auto printed = run(args);
+    std::vector<std::string> got;
+    for (const auto line: std::views::split(printed, '\n')) {
+      if (!line.empty()) {
+        got.emplace_back(std::string_view(line));
+      }
+    }
+    for (auto& file: files) {
+      file = (dir / file).string();
+    }
+    std::ranges::sort(got);
+    std::ranges::sort(files);
+    if (got != files) {
+      throw std::runtime_error(std::format(
+          "check/{}: gr {} found the wrong files:\n{}", name,
+          args.back(), printed));
+    }
+  }
+
+ private:
+  const std::string& gr;
+  const std::string name;
+  const fs::path dir;
+  const std::string out;
+};
+
+struct CheckSpec {
+  const char* name;
+  void (*run)(const Checker& c);
+};
+
+constexpr CheckSpec CHECKS[] = {
+  {"octal_escape", [](const Checker& c) {
+     // \101 is A: the digits after the first aren't literal text that every
+     // match has to have.
+     c.write("abc.txt", "ABC\n");
+     c.write("a2.txt", "A2\n");
+     c.write("digits.txt", "01BC\n");
+     c.expect({"--no-index", R"(\101BC)"}, {"abc.txt"});
+     c.expect({"--no-index", R"(\1012)"}, {"a2.txt"});
+   }},
+  {"octal_escape_index", [](const Checker& c) {
+     // Nor are they trigrams for the index to rule files out by.
+     c.write("f.txt", "xABCDEFx\n");
+     const auto index = c.scratch("index");
+     (void)c.run({"--index", "--index-file", index});
+     c.expect({"--index-file", index, R"(\101BCDEF)"}, {"f.txt"});
+   }},
+};
+
+void checks() {
+  const TempDir tmp;
+  const char* env = getenv("GR");
+  const std::string gr = env ? env : "./gr";
+  for (const auto& spec: CHECKS) {
+    const auto name = std::format("check/{}", spec.name);
+    if (!wanted(name)) {
+      continue;
+    }
+    spec.run(Checker(gr, spec.name, tmp.path));
+    std::cout << std::format("{:<36} ok\n", name);
+  }
+}
+
+// The time to read and scan each file of the corpus in turn.
+std::vector<double> per_file(const Corpus& corpus) {
+  RE2::Options options;
+  options.set_never_nl(true);
+  const RE2 scan("(?m)" + corpus.pattern, options);
+  FileBuffer buffer;
+  std::vector<double> ret;
+  for (const auto& path: corpus.files) {
+    const auto start = Clock::now();
+    FileContents contents(AT_FDCWD, path.c_str(), buffer);
+    const auto view = contents.view();
+    if (!is_binary(view.substr(0, BINARY_HEAD))) {
+      const absl::string_view text(view.data(), view.size());
+      absl::string_view m;
+      for (size_t pos = 0;
+           scan.Match(text, pos, text.size(), RE2::UNANCHORED, &m, 1);
+           pos = m.data() + m.size() - text.data()) {
+        keep(m);
+      }
+    }
+    ret.push_back(seconds(Clock::now() - start));
+  }
+  std::ranges::sort(ret);
+  return ret;
+}
+
+void end_to_end() {
+  const TempDir tmp;
+  const auto& root = tmp.path;
+
+  const char* env = getenv("GR");
+  const std::string gr = env ? env : "./gr";
+  std::mt19937_64 rng(2);
+  for (const auto& spec: CORPORA) {
+    const auto name = std::format("e2e/{}", spec.name);
+    if (!wanted(name)) {
+      continue;
+    }
+    Corpus corpus{spec.name, "needle\\d+"};
+    const auto dir = root / spec.name;
+    spec.make(corpus, dir, rng);
+    (void)run_gr(gr, corpus, dir);
+    std::vector<double> runs;
+    for (int i = 0; i < 5; ++i) {
+      runs.push_back(seconds(run_gr(gr, corpus, dir)));
+    }
+    std::ranges::sort(runs);
+    const auto t = runs[runs.size() / 2];
+    const auto lat = per_file(corpus);
+    auto pct = [&](double p) {
+      return lat[std::min(lat.size() - 1, size_t(p * lat.size()))] * 1e6;
+    };
+    std::cout << std::format(
+        "{:<36} {:9.1f} ms  {:10.0f} files/s  {:7.3f} GB/s  "
+        "p50 {:.1f} us  p99 {:.1f} us\n",
+        name, t * 1e3, corpus.files.size() / t, corpus.bytes / t / 1e9,
+        pct(0.5), pct(0.99));
+    fs::remove_all(dir);
+  }
+}
+
+}   // namespace
+
+int main(int argc, char* argv[]) {
+  filters.assign(argv + 1, argv + argc);
+  try {
+    checks();
+    micro_benchmarks();
+    end_to_end();
+  }
+  catch (const std::exception& e) {
+    std::cerr << "gr-bench: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
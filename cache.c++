@@ -0,0 +1,217 @@
+#include "cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <system_error>
+
+#include "file.h"
+
+namespace {
+
+constexpr char MAGIC[8] = {'g', 'r', '-', 'r', 'c', '1', '\n', '\0'};
+
+struct Header {
+  char magic[8];
+  uint64_t buckets;
+  uint64_t ways;
+  char pad[40];
+};
+
+static_assert(sizeof(Header) == 64);
+static_assert(std::atomic_ref<uint64_t>::is_always_lock_free);
+
+// An entry is the top 40 bits of its key, never all 0 so that an empty slot
+// is, and then its result.
+constexpr int TAG_SHIFT = 24;
+constexpr uint64_t BINARY = 1ull << 23;
+constexpr uint64_t AT_LEAST = 1ull << 22;
+
+// How long ago a file must have changed for settled().
+constexpr time_t SETTLE_SECONDS = 2;
+
+[[noreturn]] void throw_errno(const char* what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+uint64_t mix(uint64_t x) noexcept {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+int64_t ctime_ns(const struct stat& st) noexcept {
+#ifdef __APPLE__
+  const auto& t = st.st_ctimespec;
+#else
+  const auto& t = st.st_ctim;
+#endif
+  return int64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+uint64_t tag_of(uint64_t key) noexcept {
+  return (key >> TAG_SHIFT) | 1;
+}
+
+// Whether fd is a cache of the size and shape this one expects.
+bool valid(int fd, size_t len) {
+  struct stat st;
+  Header header;
+  return !fstat(fd, &st) && size_t(st.st_size) == len
+      && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+      && !std::memcmp(header.magic, MAGIC, sizeof(MAGIC));
+}
+
+// Makes the directories leading up to path, as far as it can.
+void make_parents(const std::string& path) {
+  for (auto slash = path.find('/', 1); slash != path.npos;
+       slash = path.find('/', slash + 1)) {
+    (void)mkdir(path.substr(0, slash).c_str(), 0700);
+  }
+}
+
+// Makes a new, empty cache, and puts it in place at path.  Another process
+// doing the same at the same time just means one of them loses its entries.
+int create(const std::string& path, size_t len, uint64_t buckets,
+           uint64_t ways) {
+  make_parents(path);
+  auto tmp = path + ".XXXXXX";
+  const int fd = mkstemp(tmp.data());
+  if (fd < 0) {
+    throw_errno("mkstemp");
+  }
+  Header header{};
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.buckets = buckets;
+  header.ways = ways;
+  // The rest is a hole, which reads as empty slots.
+  if (ftruncate(fd, len)
+      || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)
+      || rename(tmp.c_str(), path.c_str())) {
+    const auto e = errno;
+    close(fd);
+    unlink(tmp.c_str());
+    errno = e;
+    throw_errno("create");
+  }
+  return fd;
+}
+
+}   // namespace
+
+ResultCache::ResultCache(const std::string& path, uint64_t query)
+    : query(query), len(sizeof(Header) + BUCKETS * WAYS * sizeof(uint64_t)) {
+  int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd >= 0 && !valid(fd, len)) {
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0) {
+    fd = create(path, len, BUCKETS, WAYS);
+  }
+  data = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw_errno("mmap");
+  }
+  slots = reinterpret_cast<uint64_t*>(static_cast<char*>(data)
+                                      + sizeof(Header));
+}
+
+ResultCache::~ResultCache() {
+  munmap(data, len);
+}
+
+std::string ResultCache::default_path() {
+  if (const auto xdg = getenv("XDG_CACHE_HOME"); xdg && *xdg == '/') {
+    return std::string(xdg) + "/gr/results";
+  }
+  if (const auto home = getenv("HOME"); home && *home) {
+    return std::string(home) + "/.cache/gr/results";
+  }
+  return {};
+}
+
+uint64_t ResultCache::hash(std::string_view s, uint64_t seed) noexcept {
+  // FNV-1a, with the result mixed since its low bits pick the bucket.
+  uint64_t h = 0xcbf29ce484222325ull ^ mix(seed);
+  for (const unsigned char c: s) {
+    h ^= c;
+    h *= 0x100000001b3ull;
+  }
+  return mix(h);
+}
+
+bool ResultCache::settled(const struct stat& st) noexcept {
+  return ctime_ns(st) / 1000000000 + SETTLE_SECONDS <= time(nullptr);
+}
+
+uint64_t ResultCache::key(const struct stat& st) const noexcept {
+  auto h = query;
+  for (const uint64_t field: {uint64_t(st.st_dev), uint64_t(st.st_ino),
+                              uint64_t(st.st_size), uint64_t(mtime_ns(st)),
+                              uint64_t(ctime_ns(st))}) {
+    h = mix(h ^ mix(field));
+  }
+  return h;
+}
+
+bool ResultCache::find(uint64_t key, Result& result) const noexcept {
+  const auto b = bucket(key);
+  const auto tag = tag_of(key);
+  for (auto i = 0uz; i < WAYS; ++i) {
+    const auto entry = std::atomic_ref(b[i]).load(std::memory_order_relaxed);
+    if (entry >> TAG_SHIFT == tag) {
+      result.binary = entry & BINARY;
+      result.at_least = entry & AT_LEAST;
+      result.hits = entry & MAX_HITS;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ResultCache::add(uint64_t key, const Result& result) noexcept {
+  auto entry = tag_of(key) << TAG_SHIFT | std::min(result.hits, MAX_HITS);
+  if (result.binary) {
+    entry |= BINARY;
+  }
+  if (result.at_least || result.hits > MAX_HITS) {
+    entry |= AT_LEAST;
+  }
+  const auto b = bucket(key);
+  // The key's own slot if it has one, else an empty one, else one the key
+  // picks out.
+  for (auto i = 0uz; i < WAYS; ++i) {
+    std::atomic_ref slot(b[i]);
+    auto old = slot.load(std::memory_order_relaxed);
+    if (old >> TAG_SHIFT == entry >> TAG_SHIFT) {
+      slot.store(entry, std::memory_order_relaxed);
+      return;
+    }
+  }
+  for (auto i = 0uz; i < WAYS; ++i) {
+    uint64_t empty = 0;
+    if (std::atomic_ref(b[i]).compare_exchange_strong(
+            empty, entry, std::memory_order_relaxed)) {
+      return;
+    }
+  }
+  std::atomic_ref(b[(key >> 17) % WAYS]).store(entry,
+                                               std::memory_order_relaxed);
+}
+
+uint64_t* ResultCache::bucket(uint64_t key) const noexcept {
+  return slots + key % BUCKETS * WAYS;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+struct stat;
+
+// A persistent cache of what searches found in files, for --cache, so that
+// a search run again over a tree that's mostly as it was needn't read the
+// files it has already seen.  It's a fixed-size hash table in a file mapped
+// shared by every gr using it, with each entry a single 64-bit word: a
+// search and the identity of a file (device, inode, size, mtime and ctime)
+// hashed together, and what searching it came to.  Entries are read and
+// written with plain atomic loads, stores and compare-and-swaps, so there's
+// no locking between processes, and a lost race just loses an entry.
+// Entries go stale when a file changes, since then its identity does, and
+// get overwritten as the table fills.
+class ResultCache {
+ public:
+  // What a search of a file came to.
+  struct Result {
+    // Whether it was skipped as binary, in which case hits is 0.
+    bool binary;
+    // Whether the search stopped at hits, rather than finding that many
+    // in the whole file.
+    bool at_least;
+    size_t hits;
+  };
+
+  // The most hits an entry can hold; more is recorded as at_least.
+  static constexpr size_t MAX_HITS = (1uz << 22) - 1;
+
+  // Maps the cache at path, creating it if need be.  query identifies the
+  // search: the patterns and everything else that decides what matches.
+  // Throws std::system_error if the cache can't be mapped.
+  ResultCache(const std::string& path, uint64_t query);
+  ~ResultCache();
+
+  ResultCache(const ResultCache&) = delete;
+  ResultCache& operator=(const ResultCache&) = delete;
+
+  // Returns the cache's default path: in $XDG_CACHE_HOME, or ~/.cache, or
+  // empty if neither is set.
+  static std::string default_path();
+
+  // Hashes a string, the same way in every process.
+  static uint64_t hash(std::string_view s, uint64_t seed = 0) noexcept;
+
+  // Whether the file st describes last changed long enough ago to be worth
+  // adding: a change within the same tick of a coarse clock wouldn't show.
+  static bool settled(const struct stat& st) noexcept;
+
+  // The key of the file st describes.
+  uint64_t key(const struct stat& st) const noexcept;
+
+  // Looks the key up, setting result and returning true if it's there.
+  bool find(uint64_t key, Result& result) const noexcept;
+
+  void add(uint64_t key, const Result& result) noexcept;
+
+ private:
+  // Entries sharing a bucket, which fills a cache line.
+  static constexpr size_t WAYS = 8;
+  static constexpr size_t BUCKETS = 1uz << 17;
+
+  uint64_t* bucket(uint64_t key) const noexcept;
+
+  const uint64_t query;
+  void* data = nullptr;
+  size_t len = 0;
+  uint64_t* slots = nullptr;
+};
@@ -0,0 +1,146 @@
+#include "dir.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+#include <utility>
+
+namespace {
+
+// Big enough for a few hundred entries per getdents64.
+constexpr size_t DIRENT_BUFFER_SIZE = 32uz << 10;
+
+[[noreturn]] void throw_errno(const char* what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+int open_dir(int at, const char* name) {
+  auto fd = openat(at, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    throw_errno("open");
+  }
+  return fd;
+}
+
+bool is_dot_or_dotdot(const char* name) {
+  return name[0] == '.'
+      && (!name[1] || (name[1] == '.' && !name[2]));
+}
+
+#ifdef __linux__
+// The fixed part of the kernel's struct linux_dirent64; the name follows
+// d_type.
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+};
+
+constexpr size_t D_NAME_OFFSET = offsetof(linux_dirent64, d_type) + 1;
+#endif
+
+}   // namespace
+
+Dir::Dir(int at, const char* name, std::string path)
+    : fd(open_dir(at, name)), path(std::move(path)) {}
+
+Dir::~Dir() {
+  close(fd);
+}
+
+#ifdef __linux__
+
+DirReader::DirReader(const Dir& dir, FileBuffer& buffer)
+    : fd(dir.fd), buffer(buffer) {
+  buffer.reserve(DIRENT_BUFFER_SIZE);
+}
+
+DirReader::~DirReader() = default;
+
+bool DirReader::next(Entry& entry) {
+  while (true) {
+    if (pos == end) {
+      auto n = syscall(SYS_getdents64, fd, buffer.data.get(), buffer.capacity);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw_errno("getdents64");
+      }
+      if (!n) {
+        return false;
+      }
+      pos = 0;
+      end = n;
+    }
+    const char* p = buffer.data.get() + pos;
+    linux_dirent64 d;
+    std::memcpy(&d, p, D_NAME_OFFSET);
+    pos += d.d_reclen;
+    if (!is_dot_or_dotdot(p + D_NAME_OFFSET)) {
+      entry = {p + D_NAME_OFFSET, d.d_type};
+      return true;
+    }
+  }
+}
+
+#else
+
+// fdopendir takes over the fd it's given, and the Dir still needs its own.
+DirReader::DirReader(const Dir& dir, FileBuffer&) {
+  auto fd = fcntl(dir.fd, F_DUPFD_CLOEXEC, 0);
+  if (fd < 0) {
+    throw_errno("dup");
+  }
+  dirp = fdopendir(fd);
+  if (!dirp) {
+    close(fd);
+    throw_errno("fdopendir");
+  }
+}
+
+DirReader::~DirReader() {
+  closedir(dirp);
+}
+
+bool DirReader::next(Entry& entry) {
+  while (true) {
+    errno = 0;
+    auto d = readdir(dirp);
+    if (!d) {
+      if (errno) {
+        throw_errno("readdir");
+      }
+      return false;
+    }
+    if (!is_dot_or_dotdot(d->d_name)) {
+      entry = {d->d_name, d->d_type};
+      return true;
+    }
+  }
+}
+
+#endif
+
+std::string join(std::string_view dir, std::string_view name) {
+  std::string path;
+  join_to(path, dir, name);
+  return path;
+}
+
+void join_to(std::string& path, std::string_view dir, std::string_view name) {
+  path.assign(dir);
+  if (!path.empty() && !path.ends_with('/')) {
+    path += '/';
+  }
+  path += name;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <dirent.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "file.h"
+
+class IgnoreRules;
+
+// An open directory.  The jobs for its entries share it, so that they can
+// open them relative to its fd rather than by path.
+class Dir {
+ public:
+  // Opens name relative to the directory at, which may be AT_FDCWD.  path is
+  // what to call it in messages.  Throws std::system_error.
+  Dir(int at, const char* name, std::string path);
+  ~Dir();
+
+  Dir(const Dir&) = delete;
+  Dir& operator=(const Dir&) = delete;
+
+  const int fd;
+  const std::string path;
+  // What applies to the entries; set before the Dir is shared.
+  std::shared_ptr<const IgnoreRules> ignore;
+};
+
+// Reads the entries of a Dir, other than . and .., using getdents64 where
+// there is one and readdir elsewhere.  Either way the type comes from d_type,
+// which is DT_UNKNOWN on filesystems that don't fill it in.
+class DirReader {
+ public:
+  struct Entry {
+    const char* name;
+    unsigned char type;
+  };
+
+  // Reads through buffer, which must outlive the reader.
+  DirReader(const Dir& dir, FileBuffer& buffer);
+  ~DirReader();
+
+  DirReader(const DirReader&) = delete;
+  DirReader& operator=(const DirReader&) = delete;
+
+  // Sets entry to the next one and returns true, or returns false at the
+  // end.  The name is good until the next call.  Throws std::system_error.
+  bool next(Entry& entry);
+
+ private:
+#ifdef __linux__
+  const int fd;
+  FileBuffer& buffer;
+  size_t pos = 0;
+  size_t end = 0;
+#else
+  DIR* dirp;
+#endif
+};
+
+// Appends name to dir the way std::filesystem::path's operator/ does.
+std::string join(std::string_view dir, std::string_view name);
+// The same, into path, reusing what it has allocated.
+void join_to(std::string& path, std::string_view dir, std::string_view name);
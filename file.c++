@@ -0,0 +1,281 @@
+#include "file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include "zip.h"
+
+namespace {
+
+[[noreturn]] void throw_errno(const char* what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+}   // namespace
+
+int64_t mtime_ns(const struct stat& st) noexcept {
+#ifdef __APPLE__
+  const auto& t = st.st_mtimespec;
+#else
+  const auto& t = st.st_mtim;
+#endif
+  return int64_t(t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+char* FileBuffer::reserve(size_t n, size_t keep) {
+  if (n > capacity) {
+    auto bigger = std::make_unique_for_overwrite<char[]>(n);
+    if (keep) {
+      std::memcpy(bigger.get(), data.get(), keep);
+    }
+    data = std::move(bigger);
+    capacity = n;
+  }
+  return data.get();
+}
+
+FileContents::FileContents(int at, const char* path, FileBuffer& buffer,
+                           bool allow_stream, bool decompress)
+    : buffer(buffer) {
+  open(at, path);
+  load(allow_stream, decompress);
+}
+
+FileContents::FileContents(int fd, std::string_view head, FileBuffer& buffer,
+                           bool allow_stream, bool decompress)
+    : buffer(buffer), fd(fd) {
+  read_size();
+  if (decompress && !pipe && !head.empty()) {
+    // The magic number is in head, if there is one.
+    decompress = false;
+    try {
+      start_decoding(head);
+    }
+    catch (...) {
+      close(fd);
+      throw;
+    }
+  }
+  if (!decoder && head.size() >= len) {
+    // head has all of it.
+    data = head.data();
+    size = offset = len;
+    return;
+  }
+  load(allow_stream, decompress);
+}
+
+// Maps or reads the file, or its first chunk, closing it on failure.  If
+// decompress is set, it's yet to be seen whether it's compressed.
+void FileContents::load(bool allow_stream, bool decompress) {
+  try {
+    if (decompress && !pipe) {
+      char magic[Decoder::MAGIC_SIZE];
+      start_decoding(std::string_view(magic, read_raw(magic, sizeof(magic),
+                                                      0)));
+    }
+    if (pipe || decoder) {
+      data = buffer.reserve(CHUNK_SIZE);
+      fill(CHUNK_SIZE);
+      if (decompress && pipe && start_decoding(view())) {
+        // That was the start of what's to be decompressed.
+        size = offset = 0;
+        fill(CHUNK_SIZE);
+      }
+      while (!allow_stream && !done()) {
+        // Doubling, since there's no knowing how much more there is.
+        data = buffer.reserve(std::max(2 * size, size + CHUNK_SIZE), size);
+        fill(buffer.capacity - size);
+      }
+    }
+    else if (allow_stream && len >= STREAM_THRESHOLD) {
+      data = buffer.reserve(CHUNK_SIZE);
+      fill(CHUNK_SIZE);
+    }
+    else if (len >= MMAP_THRESHOLD) {
+      auto p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        throw_errno("mmap");
+      }
+      (void)madvise(p, len, MADV_SEQUENTIAL);
+      data = static_cast<const char*>(p);
+      size = offset = len;
+      mapped = true;
+    }
+    else {
+      data = buffer.reserve(len);
+      fill(len);
+    }
+  }
+  catch (...) {
+    close(fd);
+    throw;
+  }
+}
+
+FileContents::FileContents(int at, const char* path, FileBuffer& buffer,
+                           size_t begin, size_t end)
+    : buffer(buffer) {
+  open(at, path);
+  len = std::min(len, end);
+  offset = first = std::min(len, begin);
+  try {
+    data = buffer.reserve(CHUNK_SIZE);
+    fill(CHUNK_SIZE);
+  }
+  catch (...) {
+    close(fd);
+    throw;
+  }
+}
+
+FileContents::~FileContents() {
+  if (mapped) {
+    munmap(const_cast<char*>(data), size);
+  }
+  close(fd);
+}
+
+void FileContents::advance(size_t drop) {
+  const auto keep = size - drop;
+  std::memmove(buffer.data.get(), data + drop, keep);
+  data = buffer.reserve(keep + CHUNK_SIZE, keep);
+  size = keep;
+  fill(CHUNK_SIZE);
+}
+
+size_t FileContents::skip_lines(size_t pos, size_t& n) const {
+  char buf[16uz << 10];
+  auto passed = 0uz;
+  // Whether the last byte seen was mid-line.
+  bool partial = false;
+  while (passed < n && pos < len) {
+    auto got = pread(fd, buf, std::min(sizeof(buf), len - pos), pos);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw_errno("read");
+    }
+    if (!got) {
+      break;
+    }
+    const char* p = buf;
+    const char* const end = buf + got;
+    while (passed < n) {
+      auto nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+      if (!nl) {
+        break;
+      }
+      ++passed;
+      p = nl + 1;
+    }
+    pos += passed < n ? got : p - buf;
+    partial = passed < n && p != end;
+  }
+  if (passed < n) {
+    n = passed + partial;
+    return len;
+  }
+  return pos;
+}
+
+void FileContents::open(int at, const char* path) {
+  fd = openat(at, path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw_errno("open");
+  }
+  read_size();
+}
+
+bool FileContents::start_decoding(std::string_view raw) {
+  decoder = Decoder::detect(raw);
+  if (!decoder) {
+    return false;
+  }
+  zbuf = std::make_unique_for_overwrite<char[]>(std::max(ZIP_CHUNK,
+                                                         raw.size()));
+  std::memcpy(zbuf.get(), raw.data(), raw.size());
+  zin = std::string_view(zbuf.get(), raw.size());
+  raw_offset = raw.size();
+  len = SIZE_MAX;
+  return true;
+}
+
+void FileContents::read_size() {
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    throw_errno("fstat");
+  }
+  pipe = !S_ISREG(st.st_mode);
+  len = pipe ? SIZE_MAX : st.st_size;
+}
+
+// Reads up to want more bytes onto the end of the buffer.  The file may have
+// shrunk since the fstat, in which case we stop where it ends now.  A pipe
+// gets one read, of whatever is there, unless it's being decompressed.
+void FileContents::fill(size_t want) {
+  want = std::min(want, len - offset);
+  auto buf = const_cast<char*>(data) + size;
+  while (want) {
+    const auto n = decoder ? decode(buf, want) : read_raw(buf, want, offset);
+    if (!n) {
+      len = offset;
+      break;
+    }
+    buf += n;
+    size += n;
+    offset += n;
+    want -= n;
+    if (pipe && !decoder) {
+      break;
+    }
+  }
+}
+
+bool FileContents::skipped_garbage() const noexcept {
+  return decoder && decoder->skipped_garbage();
+}
+
+// Decompresses up to want bytes into out, reading more of the file as the
+// decoder needs it.  Returns 0 at the end.
+size_t FileContents::decode(char* out, size_t want) {
+  while (true) {
+    if (zin.empty()) {
+      const auto got = read_raw(zbuf.get(), ZIP_CHUNK, raw_offset);
+      if (!got) {
+        if (!decoder->at_end()) {
+          throw std::system_error(std::make_error_code(std::errc::io_error),
+                                  "compressed data cut short");
+        }
+        return 0;
+      }
+      raw_offset += got;
+      zin = std::string_view(zbuf.get(), got);
+    }
+    if (const auto n = decoder->decode(zin, out, want)) {
+      return n;
+    }
+  }
+}
+
+// Reads up to n bytes at pos, or from a pipe whatever one read gives.
+size_t FileContents::read_raw(char* buf, size_t n, size_t pos) {
+  while (true) {
+    const auto got = pipe ? read(fd, buf, n) : pread(fd, buf, n, pos);
+    if (got >= 0) {
+      return got;
+    }
+    if (errno != EINTR) {
+      throw_errno("read");
+    }
+  }
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+class Decoder;
+struct stat;
+
+// A file's modification time in nanoseconds.
+int64_t mtime_ns(const struct stat& st) noexcept;
+
+// Memory for FileContents to read into.  It only ever grows, so a thread that
+// keeps one around stops allocating once it has seen its largest file.
+struct FileBuffer {
+  std::unique_ptr<char[]> data;
+  size_t capacity = 0;
+
+  // Makes room for n bytes, keeping the first `keep`.
+  char* reserve(size_t n, size_t keep = 0);
+};
+
+// The contents of a file, read with a single pread into a FileBuffer, or
+// mapped if the file is large.  Throws std::system_error if the file can't be
+// read.
+//
+// If streaming is allowed, very large files are instead read a chunk at a
+// time into the buffer, so that memory use doesn't depend on the size of the
+// file: view() is then a window that advance() moves forward.  A range of a
+// file is always streamed.
+//
+// Pipes, sockets and the like, which can't be sized or seeked, are read
+// until they end.  Streaming, each advance() takes whatever one read gives,
+// so a search of a live stream keeps up with it.
+//
+// If decompress is set, a file that starts with the magic number of a
+// format Decoder knows is decompressed as it's read, and is then much like a
+// pipe: its contents are what comes out, whose length isn't known until the
+// end.
+class FileContents {
+ public:
+  // Files at least this big get mapped rather than read.
+  static constexpr size_t MMAP_THRESHOLD = 1uz << 20;
+  // Files at least this big get streamed, if allowed.
+  static constexpr size_t STREAM_THRESHOLD = 64uz << 20;
+  // How much each advance() reads.
+  static constexpr size_t CHUNK_SIZE = 1uz << 20;
+  // How much of a compressed file each read of it takes.
+  static constexpr size_t ZIP_CHUNK = 128uz << 10;
+
+  // Opens path relative to the directory at, which may be AT_FDCWD.
+  FileContents(int at, const char* path, FileBuffer& buffer,
+               bool allow_stream = false, bool decompress = false);
+  // Takes over fd, whose start is already in head.  That's all that's used
+  // if it's the whole file; head must then outlive this.
+  FileContents(int fd, std::string_view head, FileBuffer& buffer,
+               bool allow_stream = false, bool decompress = false);
+  // Streams just the bytes in [begin, end) of the file, as if they were all
+  // there was.
+  FileContents(int at, const char* path, FileBuffer& buffer, size_t begin,
+               size_t end);
+  ~FileContents();
+
+  FileContents(const FileContents&) = delete;
+  FileContents& operator=(const FileContents&) = delete;
+
+  std::string_view view() const noexcept {
+    return std::string_view(data, size);
+  }
+
+  // Where in the file view() starts.
+  size_t view_offset() const noexcept {
+    return offset - size;
+  }
+
+  // The length of the whole file, of which view() may be only part.  For a
+  // pipe, which may not have ended, how much has come through so far, and
+  // likewise for what a compressed file holds.
+  size_t file_size() const noexcept {
+    return pipe || decoder ? offset : len;
+  }
+
+  // Whether it's a pipe or some such rather than a file.
+  bool is_pipe() const noexcept {
+    return pipe;
+  }
+
+  // Whether it's being decompressed.
+  bool is_compressed() const noexcept {
+    return decoder != nullptr;
+  }
+
+  // Whether decompressing it skipped trailing garbage, which is worth a
+  // warning.
+  bool skipped_garbage() const noexcept;
+
+  // How much of the file has been read or mapped so far.
+  size_t bytes_read() const noexcept {
+    return offset - first;
+  }
+
+  // Returns the offset just past the nth newline at or after pos, reading
+  // the file separately from view().  If the file ends first, returns its
+  // length and sets n to the number of lines passed, counting a last one
+  // without a newline.
+  size_t skip_lines(size_t pos, size_t& n) const;
+
+  // Whether view() extends to the end of the file.  A pipe ends once a read
+  // of it says so.
+  bool done() const noexcept {
+    return offset == len;
+  }
+
+  // Drops the first `drop` bytes of view() and appends the next chunk of the
+  // file to what's left.  Pointers into the old view() are invalidated.
+  void advance(size_t drop);
+
+ private:
+  void open(int at, const char* path);
+  void read_size();
+  void load(bool allow_stream, bool decompress);
+  // Sets up to decompress the file if raw, the start of it, is compressed.
+  bool start_decoding(std::string_view raw);
+  void fill(size_t want);
+  size_t decode(char* out, size_t want);
+  size_t read_raw(char* buf, size_t n, size_t pos);
+
+  FileBuffer& buffer;
+  int fd = -1;
+  const char* data = nullptr;
+  size_t size = 0;
+  // How much of the file has been read (or mapped), and how much there is.
+  size_t offset = 0;
+  size_t len = 0;
+  // Where a range starts.
+  size_t first = 0;
+  bool mapped = false;
+  // If so, len is SIZE_MAX until the end turns up.
+  bool pipe = false;
+  // And likewise if there's one of these, when offset and len are in what
+  // comes out of it.  zin is the part of zbuf it's yet to take, and
+  // raw_offset how much of the file itself has been read.
+  std::unique_ptr<Decoder> decoder;
+  std::unique_ptr<char[]> zbuf;
+  std::string_view zin;
+  size_t raw_offset = 0;
+};
@@ -0,0 +1,126 @@
+#include "filter.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "dir.h"
+#include "ignore.h"
+
+using namespace std::string_view_literals;
+
+namespace {
+
+constexpr FileType TYPES[] = {
+  {"c"sv, "c h"sv, ""sv},
+  {"cmake"sv, "cmake"sv, "CMakeLists.txt"sv},
+  {"cpp"sv, "C c++ cc cpp cxx H h h++ hh hpp hxx inl ipp tcc"sv, ""sv},
+  {"css"sv, "css less sass scss"sv, ""sv},
+  {"go"sv, "go"sv, "go.mod go.sum"sv},
+  {"html"sv, "htm html xhtml"sv, ""sv},
+  {"java"sv, "java"sv, ""sv},
+  {"js"sv, "cjs js jsx mjs"sv, ""sv},
+  {"json"sv, "json jsonl"sv, ""sv},
+  {"make"sv, "mak mk"sv, "GNUmakefile Makefile makefile"sv},
+  {"md"sv, "markdown md"sv, ""sv},
+  {"objc"sv, "h m mm"sv, ""sv},
+  {"py"sv, "py pyi"sv, ""sv},
+  {"rust"sv, "rs"sv, "Cargo.lock Cargo.toml"sv},
+  {"sh"sv, "bash sh zsh"sv, ""sv},
+  {"sql"sv, "sql"sv, ""sv},
+  {"toml"sv, "toml"sv, ""sv},
+  {"ts"sv, "cts mts ts tsx"sv, ""sv},
+  {"txt"sv, "txt"sv, ""sv},
+  {"xml"sv, "xml xsd xsl"sv, ""sv},
+  {"yaml"sv, "yaml yml"sv, ""sv},
+};
+
+static_assert(std::ranges::is_sorted(TYPES, {}, &FileType::name),
+              "TYPES must be sorted");
+
+// Adds each of the space-separated words to set.
+void add_words(std::unordered_set<std::string_view>& set,
+               std::string_view words) {
+  while (words.size()) {
+    const auto end = std::min(words.find(' '), words.size());
+    set.insert(words.substr(0, end));
+    words.remove_prefix(std::min(end + 1, words.size()));
+  }
+}
+
+}   // namespace
+
+const std::span<const FileType> FILE_TYPES = TYPES;
+
+const FileType* find_file_type(std::string_view name) {
+  const auto it = std::ranges::lower_bound(TYPES, name, {}, &FileType::name);
+  return it != std::end(TYPES) && it->name == name ? it : nullptr;
+}
+
+FileFilter::FileFilter(std::span<const std::string_view> types,
+                       std::span<const std::string_view> globs,
+                       size_t max_size)
+    : include(glob_set_options(), RE2::ANCHOR_BOTH),
+      exclude(glob_set_options(), RE2::ANCHOR_BOTH), max_size(max_size) {
+  for (const auto name: types) {
+    const auto type = find_file_type(name);
+    add_words(extensions, type->extensions);
+    add_words(this->names, type->names);
+  }
+  for (auto glob: globs) {
+    const bool negated = glob.starts_with('!');
+    if (negated) {
+      glob.remove_prefix(1);
+    }
+    // Either way, it's matched against the end of the path.
+    while (glob.starts_with('/')) {
+      glob.remove_prefix(1);
+    }
+    while (glob.ends_with('/')) {
+      glob.remove_suffix(1);
+    }
+    auto& set = negated ? exclude : include;
+    if (glob.empty()
+        || set.Add(to_absl(glob_to_regexp(glob, false)), nullptr) < 0) {
+      throw std::invalid_argument("invalid glob: '" + std::string(glob)
+                                  + "'");
+    }
+    (negated ? any_exclude : any_include) = true;
+    by_path |= glob.contains('/');
+  }
+  if ((any_include && !include.Compile())
+      || (any_exclude && !exclude.Compile())) {
+    throw std::invalid_argument("too many globs");
+  }
+}
+
+bool FileFilter::wants_file(std::string_view dir_path,
+                            std::string_view name) const {
+  if (!extensions.empty() || !names.empty()) {
+    const auto dot = name.rfind('.');
+    // A name that's all extension, like .bashrc, hasn't got one.
+    if (!((dot && dot != name.npos
+           && extensions.contains(name.substr(dot + 1)))
+          || names.contains(name))) {
+      return false;
+    }
+  }
+  if (any_include && !matches(include, dir_path, name)) {
+    return false;
+  }
+  return !any_exclude || !matches(exclude, dir_path, name);
+}
+
+bool FileFilter::wants_dir(std::string_view dir_path,
+                           std::string_view name) const {
+  return !any_exclude || !matches(exclude, dir_path, name);
+}
+
+bool FileFilter::matches(const RE2::Set& set, std::string_view dir_path,
+                         std::string_view name) const {
+  if (!by_path) {
+    return set.Match(to_absl(name), nullptr);
+  }
+  thread_local std::string path;
+  join_to(path, dir_path, name);
+  return set.Match(to_absl(path), nullptr);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <re2/set.h>
+
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+// A kind of file for -t, going by its extension or else its whole name.
+struct FileType {
+  std::string_view name;
+  // Space-separated, without the dot.
+  std::string_view extensions;
+  // Space-separated names that are of the type whatever their extension.
+  std::string_view names;
+};
+
+// Sorted by name.
+extern const std::span<const FileType> FILE_TYPES;
+
+// Returns the type called name, or null if there's none.
+const FileType* find_file_type(std::string_view name);
+
+// Decides which entries the walk passes over, for -t, -g and --max-filesize.
+// It goes by their names, and by their sizes only if asked to, so that
+// what's left out costs about as little as ignoring it.  Shared read-only by
+// the walkers.
+class FileFilter {
+ public:
+  // types must all be known to find_file_type().  A glob is as in a
+  // .gitignore, with a leading ! for one that leaves files out.  Throws
+  // std::invalid_argument for a glob that doesn't make sense.
+  FileFilter(std::span<const std::string_view> types,
+             std::span<const std::string_view> globs, size_t max_size);
+
+  // Whether a file named name, in the directory at dir_path, is to be
+  // searched: it's of one of the types and matches one of the globs, if
+  // there are any of either, and matches none of the globs with a !.
+  bool wants_file(std::string_view dir_path, std::string_view name) const;
+
+  // Whether a directory is to be walked: no glob with a ! leaves it out.
+  bool wants_dir(std::string_view dir_path, std::string_view name) const;
+
+  // Whether a file of size bytes is to be searched.
+  bool wants_size(size_t size) const noexcept {
+    return size <= max_size;
+  }
+
+  // Whether wants_size() can say no, so that sizes are worth getting.
+  bool checks_size() const noexcept {
+    return max_size != SIZE_MAX;
+  }
+
+ private:
+  // Whether what a glob sees of the entry, its name or, for a glob with a
+  // slash in it, the end of its path, matches any of set.
+  bool matches(const RE2::Set& set, std::string_view dir_path,
+               std::string_view name) const;
+
+  std::unordered_set<std::string_view> extensions;
+  std::unordered_set<std::string_view> names;
+  RE2::Set include;
+  RE2::Set exclude;
+  bool any_include = false;
+  bool any_exclude = false;
+  // Whether a glob has a slash in it, so that it needs the whole path.
+  bool by_path = false;
+  const size_t max_size;
+};
@@ -1,28 +1,47 @@
 #include <absl/strings/string_view.h>
+#include <fcntl.h>
 #include <re2/re2.h>
+#include <re2/set.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-#include <array>
+#include <algorithm>
 #include <atomic>
+#include <cerrno>
 #include <cstddef>
 #include <exception>
-#include <filesystem>
-#include <fstream>
+#include <format>
 #include <iostream>
+#include <iterator>
 #include <memory>
-#include <optional>
+#include <mutex>
+#include <ranges>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <system_error>
 #include <thread>
 #include <utility>
 #include <vector>
 
+#include "arena.h"
+#include "cache.h"
 #include "circle_queue.h"
+#include "dir.h"
+#include "file.h"
+#include "filter.h"
+#include "ignore.h"
+#include "index.h"
 #include "io.h"
 #include "job.h"
+#include "literal.h"
 #include "opts.h"
-
-namespace fs = std::filesystem;
+#include "order.h"
+#include "prefetch.h"
+#include "stats.h"
+#include "text.h"
+#include "topology.h"
 
 using namespace std::string_view_literals;
 
@@ -32,198 +51,1282 @@ namespace {
 
 constexpr std::string_view BOLD_ON { "\x1b[1m" };
 constexpr std::string_view BOLD_OFF { "\x1b[0m" };
+// Which goes into the cache's keys too, in case what matches changes.
+constexpr std::string_view VERSION { "0.2.0" };
 
 [[noreturn]] void version() {
-  mPrintLn("gr version 0.2.0");
+  mPrintLn("gr version {}", VERSION);
   exit(0);
 }
 
-static bool is_binary(std::string_view buf) {
-  if (!buf.size()) {
-    return false;
-  }
-  if (buf.starts_with("\xef\xbb\xbf")) {
-    // UTF-8 BOM
-    return false;
+[[noreturn]] void type_list() {
+  for (const auto& type: FILE_TYPES) {
+    std::string line(type.name);
+    line += ':';
+    for (const auto ext: type.extensions | std::views::split(' ')) {
+      line += " *.";
+      line += std::string_view(ext);
+    }
+    for (const auto name: type.names | std::views::split(' ')) {
+      line += ' ';
+      line += std::string_view(name);
+    }
+    mPrintLn("{}", line);
   }
-  if (buf.starts_with("%PDF-")) {
-    return true;
+  exit(0);
+}
+
+// Whether a match starting at offset in view starts past its last line: in
+// (?m) mode, patterns like ^$ match the empty string after a final newline.
+inline bool past_last_line(std::string_view view, size_t offset) {
+  return offset == view.size() && (view.empty() || view.ends_with('\n'));
+}
+
+// Whether a scan of the whole buffer in (?m) mode finds a match on every line
+// that a per-line match would.  \A, \z and (?-m) anchor to the text rather
+// than to the line.
+static bool scan_safe(std::string_view pattern) {
+  for (auto i = 0uz; i + 1 < pattern.size(); ++i) {
+    if (pattern[i] == '\\') {
+      if (pattern[i + 1] == 'A' || pattern[i + 1] == 'z') {
+        return false;
+      }
+      ++i;
+    }
+    else if (pattern[i] == '(' && pattern[i + 1] == '?') {
+      auto flags = pattern.substr(i + 2);
+      flags = flags.substr(0, flags.find_first_of(":)"));
+      auto neg = flags.find('-');
+      if (neg != flags.npos && flags.find('m', neg) != flags.npos) {
+        return false;
+      }
+    }
   }
-  if (buf.find('\0') != buf.npos) {
-    return true;
+  return true;
+}
+
+// Whether the pattern has an assertion that could match at the point where
+// truncate_span cuts a long line but not at the same point in the full line.
+static bool end_sensitive(std::string_view pattern) {
+  for (auto i = 0uz; i < pattern.size(); ++i) {
+    if (pattern[i] == '$') {
+      return true;
+    }
+    if (pattern[i] == '\\' && ++i < pattern.size()
+        && (pattern[i] == 'b' || pattern[i] == 'B')) {
+      return true;
+    }
   }
   return false;
 }
 
-inline constexpr absl::string_view to_absl(std::string_view view) {
-  return absl::string_view(view.begin(), view.size());
+// Whether the pattern asks for an uppercase letter, for --smart-case.
+// Escapes like \S and \p{Lu} don't count.
+static bool has_upper(std::string_view pattern, bool literal) {
+  for (auto i = 0uz; i < pattern.size(); ++i) {
+    if (!literal && pattern[i] == '\\' && ++i < pattern.size()) {
+      if ((pattern[i] == 'p' || pattern[i] == 'P')
+          && pattern.substr(i + 1).starts_with('{')) {
+        i = std::min(pattern.find('}', i), pattern.size());
+      }
+      continue;
+    }
+    if ('A' <= pattern[i] && pattern[i] <= 'Z') {
+      return true;
+    }
+  }
+  return false;
 }
 
 class SyncedRe {
  public:
-  explicit SyncedRe(std::string_view pattern, const RE2::Options& options)
-      : pattern(std::move(pattern)), options(options) {}
+  // More than one pattern is searched for as one alternation of them all,
+  // so that each byte is only scanned once however many there are.  With
+  // keep_set, which() can tell them apart.  For multiline searches, ^ and $
+  // still match at line boundaries.
+  SyncedRe(std::vector<std::string> patterns, const RE2::Options& options,
+           bool multiline, bool keep_set)
+      : patterns(std::move(patterns)), pattern(join(this->patterns, options)),
+        options(alternation_options(this->patterns, options)),
+        set_options(options), multiline(multiline), keep_set(keep_set) {}
 
   operator const re2::RE2&() const {
     init();
     return *expr;
   }
 
+  // Expr and the scanner for one thread.  RE2 objects are safe to share,
+  // but threads sharing one take turns at the locks around its DFA caches,
+  // and fill and throw out each other's states.
+  struct Copy {
+    const re2::RE2* expr = nullptr;
+    const re2::RE2* scan = nullptr;
+    std::unique_ptr<re2::RE2> owned_expr;
+    std::unique_ptr<re2::RE2> owned_scan;
+  };
+
+  // Fills in copy unless it's filled in already.  The first thread to ask
+  // gets the originals, so that a search one thread can do alone only
+  // compiles once.
+  const Copy& copy_to(Copy& copy) const {
+    if (copy.expr) {
+      return copy;
+    }
+    init();
+    if (!lent.exchange(true, std::memory_order_relaxed)) {
+      copy.expr = expr.get();
+      copy.scan = scan.get();
+      return copy;
+    }
+    copy.owned_expr = std::make_unique<re2::RE2>(expr->pattern(),
+                                                 expr->options());
+    copy.expr = copy.owned_expr.get();
+    if (scan) {
+      copy.owned_scan = std::make_unique<re2::RE2>(scan->pattern(),
+                                                   scan->options());
+      copy.scan = copy.owned_scan.get();
+    }
+    return copy;
+  }
+
+  // The expression compiled for whole-buffer scanning: ^ and $ match at line
+  // boundaries and no match spans a newline, so any line that matches expr
+  // contains a match of the scanner.  The converse need not hold, so callers
+  // still check candidate lines against expr.  Null if the pattern can't be
+  // scanned this way.
+  const re2::RE2* scanner() const {
+    init();
+    return scan.get();
+  }
+
+  // Whether a line cut short by truncate_span may match where the scanner,
+  // seeing the whole line, finds nothing.
+  bool scan_end_sensitive() const {
+    return !options.literal() && end_sensitive(pattern);
+  }
+
+  // A string that every matching line contains, or empty.  If the pattern
+  // is literal then this is the pattern itself, and containing it is the
+  // same as matching.
+  std::string_view required() const {
+    init();
+    return literal;
+  }
+
+  bool is_literal() const {
+    return options.literal();
+  }
+
+  // Whether a match is just an occurrence of required(), as it is for a
+  // pattern with nothing special in it.
+  bool just_literal() const {
+    init();
+    return plain;
+  }
+
+  bool case_sensitive() const {
+    return options.case_sensitive();
+  }
+
+  // Sets ids to the numbers, from 1, of the patterns that match text, for
+  // which keep_set must have been given.
+  void which(std::string_view text, std::vector<int>& ids) const {
+    init();
+    ids.clear();
+    set->Match(to_absl(text), &ids);
+    std::sort(ids.begin(), ids.end());
+    for (auto& id: ids) {
+      ++id;
+    }
+  }
+
   inline void init() const {  // must be const since it's called from ^
     std::call_once(compile_expr, [this]{
-      expr = std::make_unique<re2::RE2>(to_absl(pattern), options);
+      const auto source = multiline && !options.literal()
+          ? std::format("(?m){}", pattern) : std::string(pattern);
+      expr = std::make_unique<re2::RE2>(source, options);
       if (!expr->ok()) {
+        // Blame the pattern itself rather than the alternation.
+        for (const auto& p: patterns) {
+          re2::RE2 one(p, set_options);
+          if (!one.ok()) {
+            mPrintLn(std::cerr, "Failed to compile regexp /{}/: {}",
+                     p, one.error());
+            exit(2);
+          }
+        }
         mPrintLn(std::cerr, "Failed to compile regexp /{}/: {}",
                  pattern, expr->error());
         exit(2);
       }
+      if (keep_set) {
+        compile_set();
+      }
+      if (multiline) {
+        return;
+      }
+      if (options.literal()) {
+        if (options.case_sensitive() && !pattern.contains('\n')) {
+          literal = pattern;
+          plain = true;
+        }
+      }
+      else if (options.case_sensitive()) {
+        literal = required_literal(pattern);
+        // RE2 does about as well on its own with very short ones.
+        if (literal.size() < 3) {
+          literal.clear();
+        }
+        plain = !literal.empty() && RE2::QuoteMeta(literal) == pattern;
+      }
+      if (!options.literal() && !scan_safe(pattern)) {
+        return;
+      }
+      auto scan_options = options;
+      scan_options.set_never_nl(true);
+      scan_options.set_log_errors(false);
+      auto scan_pattern = options.literal()
+          ? std::string(pattern) : std::format("(?m){}", pattern);
+      scan = std::make_unique<re2::RE2>(scan_pattern, scan_options);
+      if (!scan->ok()) {
+        scan.reset();
+      }
     });
   }
 
  private:
-  const std::string_view pattern;
-  const RE2::Options& options;
+  static std::string join(const std::vector<std::string>& patterns,
+                          const RE2::Options& options) {
+    if (patterns.size() == 1) {
+      return patterns.front();
+    }
+    std::string ret;
+    for (const auto& p: patterns) {
+      if (ret.size()) {
+        ret += '|';
+      }
+      ret += "(?:";
+      ret += options.literal() ? RE2::QuoteMeta(p) : p;
+      ret += ')';
+    }
+    return ret;
+  }
+
+  static RE2::Options alternation_options(
+      const std::vector<std::string>& patterns, RE2::Options options) {
+    if (patterns.size() != 1) {
+      // Literal ones have been quoted, and errors are blamed on the pattern.
+      options.set_literal(false);
+      options.set_log_errors(false);
+    }
+    return options;
+  }
+
+  void compile_set() const {
+    set = std::make_unique<RE2::Set>(set_options, RE2::UNANCHORED);
+    for (const auto& p: patterns) {
+      std::string error;
+      if (set->Add(to_absl(p), &error) < 0) {
+        mPrintLn(std::cerr, "Failed to compile regexp /{}/: {}", p, error);
+        exit(2);
+      }
+    }
+    if (!set->Compile()) {
+      mPrintLn(std::cerr, "Failed to compile pattern set: out of memory");
+      exit(2);
+    }
+  }
+
+  const std::vector<std::string> patterns;
+  const std::string pattern;
+  const RE2::Options options;
+  const RE2::Options set_options;
+  const bool multiline;
+  const bool keep_set;
   mutable std::unique_ptr<re2::RE2> expr;
+  mutable std::unique_ptr<RE2::Set> set;
+  mutable std::unique_ptr<re2::RE2> scan;
+  mutable std::string literal;
+  mutable bool plain = false;
   mutable std::once_flag compile_expr;
+  mutable std::atomic<bool> lent = false;
 };
 
 struct GlobalState {
   const Opts opts;
   const SyncedRe expr;
   WorkQueue queue;
+  Output out;
+  // With --sort, what puts the output in order.
+  std::unique_ptr<OrderedOutput> order;
+  // With -t, -g or --max-filesize.
+  std::unique_ptr<const FileFilter> filter;
   std::atomic_flag matched_one = ATOMIC_FLAG_INIT;
+  // With --index, where files go instead of being searched.
+  std::unique_ptr<IndexWriter> index_writer;
+  // An index to search with, and which of its files may match.
+  std::unique_ptr<const Index> index;
+  std::vector<bool> candidates;
+  // With --stats, each worker's once it's done.
+  std::vector<Stats> stats;
+  // With --pin-threads, where each worker goes.
+  std::unique_ptr<const Topology> topology;
+  // With --cache, what earlier searches found.
+  std::unique_ptr<ResultCache> cache;
 };
 
-class CompileReJob : public Job {
- public:
-  explicit CompileReJob(const GlobalState& state): state(state) {}
+struct Match {
+  size_t line;
+  std::string_view text;
+  bool truncated;
+  bool is_context;
+  // Where the line starts in the file, for --json.
+  size_t offset;
+};
 
-  void operator()() override {
-    state.expr.init();
+struct Context {
+  std::string_view text;
+  bool truncated;
+  size_t offset;
+};
+
+// A big file that SearchJobs search a range at a time.  Each range starts at
+// a line and is scanned on past its end by as many lines as any context can
+// reach, so that its results are only missing what the ranges before it
+// find.  Concatenating them in order, less repeats at the seams, gives what
+// one pass over the whole file would.
+struct SplitFile {
+  // Range i is [bounds[i], bounds[i + 1]), scanned up to ends[i], which is
+  // extra_lines[i] lines further on.
+  std::vector<size_t> bounds;
+  std::vector<size_t> ends;
+  std::vector<size_t> extra_lines;
+
+  struct Part {
+    std::vector<Match> matches;
+    Arena held;
+    // In the range itself, not counting the extra ones.
+    size_t lines = 0;
+    size_t hits = 0;
+  };
+  std::vector<Part> parts;
+
+  // Ranges not yet searched; the last one to finish prints the lot.
+  std::atomic<size_t> left;
+  std::atomic<bool> failed = false;
+  // Whether some range had binary data, which makes the whole file binary.
+  std::atomic<bool> binary = false;
+  // With --sort, where the file's output goes.
+  OrderedOutput::Node* node = nullptr;
+};
+
+}   // namespace
+
+// Everything a SearchJob needs that would otherwise be allocated per file.
+struct Scratch {
+  explicit Scratch(const Opts& opts)
+      : before_context(opts.before_context), timed(opts.stats) {}
+
+  // Where a StatTimer should add to, if anywhere.
+  uint64_t* timer(uint64_t Stats::* counter) noexcept {
+    return timed ? &(stats.*counter) : nullptr;
   }
 
- private:
-  const GlobalState& state;
+  FileBuffer file;
+  std::vector<Match> matches;
+  // With --multiline --json, where each match starts and ends in the file.
+  std::vector<std::pair<size_t, size_t>> spans;
+  CircleQueue<Context> before_context;
+  Arena held;
+  std::string path;
+  OutputBuffer out;
+  FileBuffer dirents;
+  // The entries of the directory being walked: offsets of NUL-terminated
+  // names in entry_names, and their d_types.
+  std::string entry_names;
+  std::vector<std::pair<size_t, unsigned char>> entries;
+  // For --show-pattern.
+  std::vector<int> pattern_ids;
+  std::string ids;
+  // This thread's own copy of the regexps.
+  SyncedRe::Copy re;
+  Prefetcher prefetch;
+  // For --index.
+  TrigramSet trigrams;
+  Stats stats;
+  const bool timed;
 };
 
+namespace {
+
+// Searches a batch of files from one directory, so that the cost of a job is
+// spread over several files.  A batch that gets to BATCH_BYTES of input puts
+// the rest of its files back on the queue, so that a few big files don't
+// hold up small ones that other workers could be searching.
 class SearchJob : public Job {
  public:
-  SearchJob(GlobalState& state, auto&& path)
-      : state(state), path(FWD(path)) {}
+  // Up to this many files go in a batch.
+  static constexpr size_t BATCH_FILES = 64;
+  static constexpr size_t BATCH_BYTES = 1uz << 20;
+  // Files at least this big get split into ranges when there are workers
+  // to share them, of at least MIN_RANGE each and a few per worker.
+  static constexpr size_t SPLIT_THRESHOLD = 32uz << 20;
+  static constexpr size_t MIN_RANGE = 8uz << 20;
+  // How much of a file scan() checks for binary data at a time.
+  static constexpr size_t BINARY_WINDOW = 128uz << 10;
+  // The name that means standard input, and what's printed for it.
+  static constexpr std::string_view STDIN = "-";
+  static constexpr std::string_view STDIN_PATH = "<stdin>";
+
+  // Searches the NUL-separated names in dir, or relative to the working
+  // directory if dir is null.  With --sort, each has its node in nodes.
+  SearchJob(GlobalState& state, std::shared_ptr<const Dir> dir, auto&& names,
+            std::vector<OrderedOutput::Node*> nodes = {})
+      : state(state), dir(std::move(dir)), names(FWD(names)),
+        nodes(std::move(nodes)) {}
+
+  // Searches range number `range` of a split file.
+  SearchJob(GlobalState& state, std::shared_ptr<const Dir> dir, auto&& name,
+            std::shared_ptr<SplitFile> split, size_t range)
+      : state(state), dir(std::move(dir)), names(FWD(name)),
+        split(std::move(split)), range(range) {}
 
-  void operator()() override {
+  void operator()(Scratch& scratch) override {
+    if (!nodes.empty()) {
+      state.order->wait_turn(nodes.front());
+    }
+    // Only a plain search reads every file of the batch.
+    if (state.opts.io_uring && !split && !state.index && !state.index_writer
+        && !state.cache && names.contains('\0')) {
+      prefetching = scratch.prefetch.start(at(), names, handed.size());
+    }
+    Defer d([&] {
+      if (prefetching) {
+        scratch.prefetch.finish();
+      }
+    });
+    for (auto i = 0uz; i < names.size(); i = next, ++file) {
+      name = names.c_str() + i;
+      next = i + name.size() + 1;
+      node = nodes.empty() ? nullptr : nodes[file];
+      live = false;
+      caching = false;
+      printed_line = 0;
+      search(scratch);
+      finish_node();
+    }
+    if (split) {
+      finish_range(scratch);
+      finish_node();
+    }
+  }
+
+ private:
+  void search(Scratch& scratch) {
     try {
-      run_unchecked();
+      if (split) {
+        search_range(scratch);
+      }
+      else if (state.index_writer) {
+        add_to_index(scratch);
+      }
+      else if ((!state.index || !skip_indexed(scratch))
+               && !from_cache(scratch)) {
+        run_unchecked(scratch);
+      }
     }
-    catch (const std::ios_base::failure& e) {
-      mPrintLn(std::cerr, "Error on {}: {}", path.string(), e.what());
+    catch (const std::system_error& e) {
+      if (split) {
+        split->failed = true;
+      }
+      if (e.code() == std::errc::permission_denied) {
+        mPrintLn(std::cerr, "Skipping {}: Permission denied", path());
+      }
+      else {
+        mPrintLn(std::cerr, "Error on {}: {}", path(), e.what());
+      }
     }
     catch (const std::exception& e) {
       mPrintLn(std::cerr,
-               "Unexpected exception on {}: {}", path.string(), e.what());
+               "Unexpected exception on {}: {}", path(), e.what());
       throw;
     }
   }
 
- private:
-  void run_unchecked() {
-    auto fs = std::fstream(path, std::ios_base::in);
-    fs.exceptions(fs.failbit | fs.badbit);
-    fs.seekg(0, std::ios_base::end);
-    const size_t len = fs.tellg();
-    fs.seekg(0);
-    const auto contents = std::make_unique_for_overwrite<char[]>(len);
-    const auto pre_len = std::min(512uz, len);
-    fs.read(contents.get(), pre_len);
-    if (is_binary(std::string_view(contents.get(), pre_len))) {
+  // Counts a file's size against the batch, handing off the files after it
+  // if that uses up the budget, along with what's been fetched of them.
+  void charge(Scratch& scratch, size_t size) {
+    bytes += size;
+    if (bytes >= BATCH_BYTES && next < names.size()) {
+      std::vector<OrderedOutput::Node*> rest;
+      if (!nodes.empty()) {
+        rest.assign(nodes.begin() + file + 1, nodes.end());
+        nodes.resize(file + 1);
+      }
+      auto job = std::make_unique<SearchJob>(state, dir, names.substr(next),
+                                             std::move(rest));
+      for (auto i = file + 1; i < handed.size(); ++i) {
+        job->handed.push_back(std::move(handed[i]));
+      }
+      if (prefetching) {
+        auto fetched = scratch.prefetch.release(
+            std::max(file + 1, handed.size()));
+        std::ranges::move(fetched, std::back_inserter(job->handed));
+      }
+      state.queue.push(std::move(job));
+      names.resize(next);
+    }
+  }
+
+  // With --sort, lets the file's turn come, if nothing else has.
+  void finish_node() {
+    if (node) {
+      state.order->finish(std::exchange(node, nullptr));
+    }
+  }
+
+  int at() const {
+    return dir ? dir->fd : AT_FDCWD;
+  }
+
+  // Whether the index says the file can't match, and it hasn't changed
+  // since it was indexed.
+  bool skip_indexed(Scratch& scratch) {
+    const auto id = state.index->find(pretty_path(scratch.path));
+    if (id == Index::npos || state.candidates[id]) {
+      return false;
+    }
+    struct stat st;
+    StatTimer t(scratch.timer(&Stats::stat_ns));
+    return !fstatat(at(), name.data(), &st, 0) && state.index->fresh(id, st);
+  }
+
+  // Whether the cache has the file as it is, and that's all there is to know
+  // of it: that it's binary or doesn't match, or, for -l, -c and --quiet,
+  // how many lines do.  If not, sets it up for remember() to add what
+  // searching it finds.
+  bool from_cache(Scratch& scratch) {
+    if (!state.cache || from_stdin()) {
+      return false;
+    }
+    struct stat st;
+    if (StatTimer t(scratch.timer(&Stats::stat_ns));
+        fstatat(at(), name.data(), &st, 0) || !S_ISREG(st.st_mode)) {
+      return false;
+    }
+    cache_key = state.cache->key(st);
+    ResultCache::Result r;
+    const bool counted = state.opts.lflag || state.opts.count
+        || state.opts.quiet;
+    if (!state.cache->find(cache_key, r)
+        || (r.hits && !(counted && (!r.at_least || r.hits >= limit())))) {
+      ++scratch.stats.cache_misses;
+      caching = ResultCache::settled(st);
+      return false;
+    }
+    ++scratch.stats.cache_hits;
+    ++scratch.stats.files;
+    if (r.binary) {
+      ++scratch.stats.binary_files;
+    }
+    else if (r.hits) {
+      const auto hits = std::min(r.hits, limit());
+      ++scratch.stats.matched_files;
+      scratch.stats.matched_lines += hits;
+      scratch.matches.clear();
+      print(scratch, 0, hits);
+    }
+    return true;
+  }
+
+  // With --cache, adds what searching the file came to, unless --quiet cut
+  // the search short.
+  void remember(bool binary, size_t hits) {
+    if (caching && !state.queue.cancelled()) {
+      state.cache->add(cache_key, {binary, hits == limit(), hits});
+    }
+  }
+
+  // Reads the file into the index, unless the old one has it as it is.
+  // Whatever stat says goes in the index: if the file changes before it's
+  // read, it just gets read again next time.
+  void add_to_index(Scratch& scratch) {
+    const auto path = pretty_path(scratch.path);
+    struct stat st;
+    if (StatTimer t(scratch.timer(&Stats::stat_ns));
+        fstatat(at(), name.data(), &st, 0)) {
+      throw std::system_error(errno, std::generic_category(), "stat");
+    }
+    if (state.index_writer->reuse(path, st)) {
+      return;
+    }
+    auto contents = open(scratch, true);
+    charge(scratch, contents.file_size());
+    auto& set = scratch.trigrams;
+    set.clear();
+    uint32_t flags = 0;
+    if (is_binary(contents.view().substr(0, BINARY_HEAD))) {
+      ++scratch.stats.binary_files;
+      flags = IndexFile::BINARY;
+    }
+    else {
+      while (true) {
+        const auto view = contents.view();
+        if (!set.add(view)) {
+          flags = IndexFile::UNINDEXED;
+          break;
+        }
+        if (contents.done()) {
+          break;
+        }
+        // Keep the last two bytes for the trigrams that span chunks.
+        StatTimer t(scratch.timer(&Stats::read_ns));
+        contents.advance(view.size() - std::min(view.size(), 2uz));
+      }
+    }
+    scratch.stats.bytes_read += contents.bytes_read();
+    state.index_writer->add(path, st, flags, set);
+  }
+
+  // Opens the file, counting it for --stats.
+  FileContents open(Scratch& scratch, bool allow_stream,
+                    bool decompress = false) {
+    StatTimer t(scratch.timer(&Stats::read_ns));
+    ++scratch.stats.files;
+    if (file < handed.size() && handed[file].fd >= 0) {
+      auto& h = handed[file];
+      return FileContents(h.take(), h.head,
+                          scratch.file, allow_stream, decompress);
+    }
+    if (prefetching) {
+      if (const auto f = scratch.prefetch.take(file); f.fd >= 0) {
+        return FileContents(f.fd, f.head, scratch.file, allow_stream,
+                            decompress);
+      }
+    }
+    if (from_stdin()) {
+      const int fd = dup(STDIN_FILENO);
+      if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "dup");
+      }
+      return FileContents(fd, std::string_view(), scratch.file, allow_stream,
+                          decompress);
+    }
+    return FileContents(at(), name.data(), scratch.file, allow_stream,
+                        decompress);
+  }
+
+  void run_unchecked(Scratch& scratch) {
+    // Multiline matching needs the whole file at once.
+    auto contents = open(scratch, !state.opts.multiline,
+                         state.opts.search_zip);
+    // There's no knowing how much a compressed file holds, and it's slow to
+    // get at, so it's left a job of its own: the files after it can be
+    // decompressed by other workers meanwhile.
+    charge(scratch,
+           contents.is_compressed() ? BATCH_BYTES : contents.file_size());
+    std::string_view view = contents.view();
+    // scan() looks at the rest as it goes, but scan_multiline() can't.
+    const auto sniff = state.opts.binary_sniff;
+    if (is_binary(view.substr(0, state.opts.multiline
+                                  ? sniff : std::min(sniff, BINARY_HEAD)))) {
+      ++scratch.stats.binary_files;
+      scratch.stats.bytes_read += contents.bytes_read();
+      remember(true, 0);
+      return;
+    }
+    live = contents.is_pipe() && !node;
+    // Ranges can't stop early, since the ones after need their line counts.
+    if (!state.opts.multiline && !contents.is_pipe()
+        && !contents.is_compressed()
+        && contents.file_size() >= SPLIT_THRESHOLD
+        && state.queue.workers() > 1 && limit() == SIZE_MAX) {
+      split_file(contents);
+      return;
+    }
+
+    const auto counts = timed_scan(contents, scratch, false);
+    if (contents.skipped_garbage()) {
+      mPrintLn(std::cerr, "Warning on {}: trailing garbage ignored", path());
+    }
+    remember(counts.binary, counts.binary ? 0 : counts.hits);
+    if (counts.binary) {
+      ++scratch.stats.binary_files;
+      return;
+    }
+    if (!counts.hits) {
+      return;
+    }
+    ++scratch.stats.matched_files;
+    scratch.stats.matched_lines += counts.hits;
+    print(scratch, counts.max_width, counts.hits);
+  }
+
+  bool from_stdin() const {
+    return !dir && name == STDIN;
+  }
+
+  // How many matching lines to look for in each file: -l and --quiet only
+  // need to know of one.
+  size_t limit() const {
+    return state.opts.lflag || state.opts.quiet
+        ? std::min<size_t>(state.opts.max_count, 1) : state.opts.max_count;
+  }
+
+  // Queues a job for each range of the file, starting each range at the
+  // first line to start at or after an even share of the file.
+  void split_file(const FileContents& contents) {
+    const auto size = contents.file_size();
+    const auto ranges = std::clamp(size / MIN_RANGE, 2uz,
+                                   4 * state.queue.workers());
+    auto s = std::make_shared<SplitFile>();
+    s->bounds.push_back(0);
+    for (auto i = 1uz; i < ranges; ++i) {
+      auto one = 1uz;
+      const auto b = contents.skip_lines(i * (size / ranges) - 1, one);
+      if (b > s->bounds.back() && b < size) {
+        s->bounds.push_back(b);
+      }
+    }
+    s->bounds.push_back(size);
+    const size_t context = std::max(state.opts.before_context,
+                                    state.opts.after_context);
+    const auto n = s->bounds.size() - 1;
+    for (auto i = 0uz; i < n; ++i) {
+      auto lines = context;
+      s->ends.push_back(contents.skip_lines(s->bounds[i + 1], lines));
+      s->extra_lines.push_back(lines);
+    }
+    s->parts.resize(n);
+    s->left = n;
+    s->node = std::exchange(node, nullptr);
+    for (auto i = 0uz; i < n; ++i) {
+      state.queue.push(
+          std::make_unique<SearchJob>(state, dir, name, s, i));
+    }
+  }
+
+  void search_range(Scratch& scratch) {
+    auto& part = split->parts[range];
+    FileContents contents = [&] {
+      StatTimer t(scratch.timer(&Stats::read_ns));
+      return FileContents(at(), name.data(), scratch.file,
+                          split->bounds[range], split->ends[range]);
+    }();
+    const auto counts = timed_scan(contents, scratch, true);
+    if (counts.binary) {
+      split->binary = true;
+      return;
+    }
+    part.lines = counts.lines - split->extra_lines[range];
+    part.hits = counts.hits;
+    std::swap(part.matches, scratch.matches);
+    std::swap(part.held, scratch.held);
+  }
+
+  // Once every range is done, puts the parts together and prints them.
+  void finish_range(Scratch& scratch) {
+    if (split->left.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    node = split->node;
+    if (split->failed) {
+      return;
+    }
+    if (split->binary) {
+      ++scratch.stats.binary_files;
+      return;
+    }
+    auto hits = 0uz;
+    for (const auto& part: split->parts) {
+      hits += part.hits;
+    }
+    scratch.stats.matched_files += hits != 0;
+    scratch.stats.matched_lines += hits;
+    if (state.opts.count) {
+      if (hits) {
+        print(scratch, 0, hits);
+      }
       return;
     }
-    if (len != pre_len) {
-      fs.seekg(0);
-      fs.read(contents.get(), len);
+    auto& matches = scratch.matches;
+    matches.clear();
+    auto base = 0uz;
+    for (const auto& part: split->parts) {
+      for (auto m: part.matches) {
+        m.line += base;
+        // Anything at or before the last line so far was already found by
+        // the range before, scanning past its end.
+        if (matches.empty() || m.line > matches.back().line) {
+          matches.push_back(m);
+        }
+      }
+      base += part.lines;
     }
-    std::string_view view(contents.get(), len);
-    if (state.opts.multiline
-        && !re2::RE2::PartialMatch(to_absl(view), state.expr)) {
+    if (matches.empty()) {
       return;
     }
+    auto last = std::find_if(matches.rbegin(), matches.rend(),
+                             [](const auto& m) { return !m.is_context; });
+    print(scratch, calcWidth(last->line), 0);
+  }
+
+  struct Counts {
+    size_t lines = 0;
+    size_t hits = 0;
+    uint8_t max_width = 0;
+    // Whether scan() gave up on the file on finding binary data in it.
+    bool binary = false;
+  };
+
+  // Runs scan, or scan_multiline, counting the time as regex time less any
+  // reading it does along the way.
+  Counts timed_scan(FileContents& contents, Scratch& scratch, bool is_part) {
+    const auto read_ns = scratch.stats.read_ns;
+    Counts counts;
+    {
+      StatTimer t(scratch.timer(&Stats::regex_ns));
+      counts = state.opts.multiline
+          ? scan_multiline(contents.view(), scratch)
+          : scan(contents, scratch, is_part);
+    }
+    scratch.stats.regex_ns -= scratch.stats.read_ns - read_ns;
+    scratch.stats.bytes_read += contents.bytes_read();
+    if (state.opts.multiline) {
+      scratch.stats.bytes_scanned += contents.view().size();
+    }
+    return counts;
+  }
 
-    // TODO multiline
+  // Finds the matches and context in contents, leaving them in
+  // scratch.matches unless only the number of matching lines is wanted,
+  // and stopping after limit() of them.  For all but parts of a split file
+  // the line count may stop at the last line printed, and printed text is
+  // only copied out of the buffer if the file is streamed.
+  //
+  // Each stretch of the file is checked for binary data just before it's
+  // searched, up to --binary-sniff, giving up on the file at the first.
+  Counts scan(FileContents& contents, Scratch& scratch, bool is_part) {
+    std::string_view view = contents.view();
     size_t line = 0;
-    size_t last_match = SIZE_MAX;
-    struct Match {
-      size_t line;
-      std::string_view text;
-      bool truncated;
-      bool is_context;
-    };
-    struct Context {
-      std::string_view text;
-      bool truncated;
-    };
-    std::vector<Match> matches;
-    CircleQueue<Context> before_context(state.opts.before_context);
+    size_t hits = 0;
     uint8_t max_width = 0;
-    auto try_add_match = [&, this](size_t end) {
-      auto text = truncate_span(view, end);
-      if (re2::RE2::PartialMatch(to_absl(text), state.expr)) {
+    const auto max_hits = limit();
+    const bool keep = !state.opts.count && !state.opts.lflag
+        && !state.opts.quiet;
+    bool done = !max_hits;
+    size_t last_match = SIZE_MAX;
+    // A range's hits past its end are the next range's.
+    const auto own_end = is_part ? split->bounds[range + 1] : SIZE_MAX;
+    auto& matches = scratch.matches;
+    auto& before_context = scratch.before_context;
+    auto& held = scratch.held;
+    matches.clear();
+    before_context.clear();
+    held.clear();
+    // Whether view ends at the end of the file, rather than at the end of the
+    // last whole line in the current chunk.
+    bool at_end = contents.done();
+    // Where view starts in the file.
+    auto view_offset = contents.view_offset();
+    // What the scanner said about a line: nothing, since it hasn't looked;
+    // no match; or a match, which is all we need unless the line is
+    // truncated (checked against what gets printed) or check_long is set.
+    enum class Scanned { unknown, no, yes };
+    const auto& re = state.expr.copy_to(scratch.re);
+    const auto* const scan = re.scan;
+    const auto literal = state.expr.required();
+    // Lines without the literal can't match even when truncated.
+    const bool check_long = !state.opts.llflag && literal.empty()
+        && state.expr.scan_end_sensitive();
+    // Lines found by the scanner match; lines found by the literal only may.
+    const auto found = literal.empty() || state.expr.is_literal()
+        ? Scanned::yes : Scanned::unknown;
+    // Handles the line at [pos, end), returning whether it matched.
+    auto add_line = [&, this](size_t pos, size_t end, Scanned scanned) {
+      ++line;
+      auto text = truncate_span(view.substr(pos), end - pos,
+                                state.opts.llflag);
+      const bool truncated = text.size() != end - pos;
+      const bool matched = (scanned == Scanned::yes && !truncated)
+          || ((scanned != Scanned::no || (check_long && truncated))
+              && re2::RE2::PartialMatch(to_absl(text), *re.expr));
+      if (matched) {
+        if (view_offset + pos < own_end) {
+          done = ++hits == max_hits;
+        }
+        if (!keep) {
+          return true;
+        }
         auto pre_line = line - before_context.size();
-        for (const auto [pre_text, trunc]: before_context) {
-          matches.emplace_back(pre_line++, pre_text, trunc, true);
+        for (const auto [pre_text, trunc, offset]: before_context) {
+          matches.emplace_back(pre_line++, pre_text, trunc, true, offset);
         }
         before_context.clear();
-        matches.emplace_back(line, text, end != text.size(), false);
+        matches.emplace_back(line, text, truncated, false, view_offset + pos);
         max_width = calcWidth(line);
         last_match = 0;
       }
       else if (last_match < state.opts.after_context) {
         ++last_match;
-        matches.emplace_back(line, text, end != text.size(), true);
+        matches.emplace_back(line, text, truncated, true, view_offset + pos);
       }
       else {
         if (state.opts.before_context) {
-          before_context.emplace(text, end != text.size());
+          before_context.emplace(text, truncated, view_offset + pos);
         }
       }
+      return matched;
     };
-    while (view.size()) {
-      ++line;
-      auto nl = view.find('\n');
-      if (nl == view.npos) {
-        try_add_match(view.size());
-        break;
+    // Returns the start of the first line at or after pos that contains the
+    // literal or a scanner match, or npos.
+    auto next_candidate = [&](size_t pos) {
+      size_t offset;
+      if (literal.size()) {
+        offset = find_literal(view, literal, pos);
+        if (offset == view.npos) {
+          return view.npos;
+        }
+      }
+      else {
+        absl::string_view m;
+        if (!scan->Match(to_absl(view), pos, view.size(), RE2::UNANCHORED,
+                         &m, 1)) {
+          return view.npos;
+        }
+        offset = m.data() - view.data();
+        if (past_last_line(view, offset)) {
+          return view.npos;
+        }
+      }
+      const auto nl = view.substr(pos, offset - pos).rfind('\n');
+      return nl == view.npos ? pos : pos + nl + 1;
+    };
+    // Passes over the non-candidate lines in [pos, end), where end is the
+    // start of a candidate line or the end of the buffer.  Only lines that
+    // might be printed as context are looked at individually; the rest are
+    // just counted.
+    auto skip_lines = [&](size_t pos, const size_t end) {
+      while (pos < end
+             && (check_long || last_match < state.opts.after_context)) {
+        const auto eol = std::min(view.find('\n', pos), view.size());
+        add_line(pos, eol, Scanned::no);
+        pos = eol + 1;
+      }
+      if (pos >= end) {
+        return;
+      }
+      if (end == view.size() && at_end) {
+        if (is_part) {
+          const auto rest = view.substr(pos);
+          line += count_lines(rest) + !rest.ends_with('\n');
+        }
+        return;
+      }
+      auto ctx = end;
+      for (auto i = 0uz; i < state.opts.before_context && ctx != pos; ++i) {
+        const auto nl = view.substr(pos, ctx - 1 - pos).rfind('\n');
+        ctx = nl == view.npos ? pos : pos + nl + 1;
+      }
+      line += count_lines(view.substr(pos, ctx - pos));
+      for (pos = ctx; pos < end; ) {
+        const auto eol = view.find('\n', pos);
+        add_line(pos, eol, Scanned::no);
+        pos = eol + 1;
+      }
+    };
+    // Each scanner call costs about as much as matching a line outright, so
+    // while matches come on consecutive lines, match line by line.
+    const bool can_scan = scan || literal.size();
+    bool dense = !can_scan;
+    // Whether data, at offset in the file, has binary data before the end of
+    // the sniff.
+    auto binary_at = [&](std::string_view data, size_t offset) {
+      const auto sniff = state.opts.binary_sniff;
+      return offset < sniff && has_nul(data.substr(0, sniff - offset));
+    };
+    auto search = [&](size_t pos) {
+      while (pos < view.size() && !done) {
+        if (dense) {
+          const auto eol = std::min(view.find('\n', pos), view.size());
+          dense = add_line(pos, eol, Scanned::unknown) || !can_scan;
+          pos = eol + 1;
+          continue;
+        }
+        const auto next = next_candidate(pos);
+        if (next == view.npos) {
+          skip_lines(pos, view.size());
+          break;
+        }
+        skip_lines(pos, next);
+        const auto eol = std::min(view.find('\n', next), view.size());
+        add_line(next, eol, found);
+        dense = next == pos && literal.empty();
+        pos = eol + 1;
+      }
+    };
+    if (at_end) {
+      // A window at a time, so that binary data late in a big file is only
+      // looked at once, and cuts the search short.
+      const auto all = view;
+      const auto offset = contents.view_offset();
+      auto pos = 0uz;
+      do {
+        auto whole = all.size();
+        if (whole - pos > BINARY_WINDOW) {
+          whole = std::min(all.find('\n', pos + BINARY_WINDOW),
+                           all.size() - 1) + 1;
+        }
+        if (binary_at(all.substr(pos, whole - pos), offset + pos)) {
+          return {.binary = true};
+        }
+        view = all.substr(0, whole);
+        at_end = whole == all.size();
+        search(pos);
+        pos = whole;
+      } while (!at_end && !done);
+      scratch.stats.bytes_scanned += pos;
+      if (is_part) {
+        for (auto& m: matches) {
+          m.text = held.copy(m.text);
+        }
+      }
+    }
+    else {
+      // Streaming: search the whole lines in each chunk, then carry the
+      // partial last line and the lines held for before_context over to the
+      // next one.  Printed text is copied out, since the chunk won't last.
+      auto owned = 0uz;
+      if (binary_at(contents.view(), contents.view_offset())) {
+        return {.binary = true};
+      }
+      for (size_t pos = 0;; ) {
+        const auto chunk = contents.view();
+        const auto whole = at_end ? chunk.size() : chunk.rfind('\n') + 1;
+        view = chunk.substr(0, whole);
+        search(pos);
+        scratch.stats.bytes_scanned += whole - pos;
+        for (; owned < matches.size(); ++owned) {
+          matches[owned].text = held.copy(matches[owned].text);
+        }
+        if (live && !matches.empty() && !at_end) {
+          // A live stream's matches go out as they're found.
+          print(scratch, max_width, hits);
+          matches.clear();
+          held.clear();
+          owned = 0;
+        }
+        if (at_end || done || state.queue.cancelled()) {
+          break;
+        }
+        auto drop = whole;
+        for (const auto& context: before_context) {
+          drop = std::min<size_t>(drop, context.text.data() - chunk.data());
+        }
+        {
+          StatTimer t(scratch.timer(&Stats::read_ns));
+          contents.advance(drop);
+        }
+        at_end = contents.done();
+        view_offset = contents.view_offset();
+        const auto kept = chunk.size() - drop;
+        if (binary_at(contents.view().substr(kept),
+                      contents.view_offset() + kept)) {
+          return {.binary = true};
+        }
+        const auto base = contents.view().data();
+        for (auto& context: before_context) {
+          auto& text = context.text;
+          text = std::string_view(base + (text.data() - chunk.data() - drop),
+                                  text.size());
+        }
+        pos = whole - drop;
       }
-      try_add_match(nl);
-      view.remove_prefix(nl + 1);
     }
+    return {line, hits, max_width};
+  }
 
-    if (!state.opts.multiline && matches.empty()) {
-      return;
+  // Finds every match in the whole file, which may span lines, and reports
+  // each line that some match touches as scan() would a matching line.
+  Counts scan_multiline(std::string_view view, Scratch& scratch) {
+    auto& matches = scratch.matches;
+    auto& spans = scratch.spans;
+    matches.clear();
+    spans.clear();
+    Counts counts;
+    const auto max_hits = limit();
+    const bool keep = !state.opts.count && !state.opts.lflag
+        && !state.opts.quiet;
+    const re2::RE2& re = *state.expr.copy_to(scratch.re).expr;
+    const size_t before = state.opts.before_context;
+    const size_t after = state.opts.after_context;
+    // Matches come in order, so line numbers come from a cursor that only
+    // moves forward: the line starting at cur is number cur_line.
+    auto cur = 0uz;
+    auto cur_line = 1uz;
+    // Moves the cursor to the start of the line pos is on.
+    auto line_at = [&](size_t pos) {
+      const auto nl = view.substr(cur, pos - cur).rfind('\n');
+      if (nl != view.npos) {
+        cur_line += count_lines(view.substr(cur, nl + 1));
+        cur += nl + 1;
+      }
+      return cur_line;
+    };
+    // The first line not yet added, where it starts, and the last line of
+    // after context owed.
+    auto next_line = 1uz;
+    auto next_off = 0uz;
+    auto after_until = 0uz;
+    auto add_through = [&](size_t last, bool is_context) {
+      while (next_line <= last && next_off < view.size()) {
+        const auto eol = std::min(view.find('\n', next_off), view.size());
+        if (keep) {
+          auto text = truncate_span(view.substr(next_off), eol - next_off,
+                                    state.opts.llflag);
+          matches.emplace_back(next_line, text, text.size() != eol - next_off,
+                               is_context, next_off);
+        }
+        ++next_line;
+        next_off = eol + 1;
+      }
+    };
+    for (auto pos = 0uz; pos <= view.size() && counts.hits < max_hits; ) {
+      absl::string_view m;
+      if (!re.Match(to_absl(view), pos, view.size(), RE2::UNANCHORED, &m, 1)) {
+        break;
+      }
+      const size_t start = m.data() - view.data();
+      const auto end = start + m.size();
+      if (past_last_line(view, start)) {
+        break;
+      }
+      const auto first = line_at(start);
+      const auto first_off = cur;
+      const auto last = line_at(m.empty() ? start : end - 1);
+      add_through(std::min(after_until, first - 1), true);
+      const auto context_from = std::max(next_line,
+                                         first - std::min(first - 1, before));
+      if (context_from > next_line) {
+        auto off = first_off;
+        for (auto n = first; n > context_from; --n) {
+          const auto nl = view.substr(0, off - 1).rfind('\n');
+          off = nl == view.npos ? 0 : nl + 1;
+        }
+        next_line = context_from;
+        next_off = off;
+      }
+      add_through(first - 1, true);
+      if (last >= next_line) {
+        counts.hits += last - next_line + 1;
+        counts.max_width = calcWidth(last);
+      }
+      add_through(last, false);
+      if (keep && state.opts.json) {
+        spans.emplace_back(start, end);
+      }
+      after_until = last + after;
+      if (m.empty()) {
+        // Any other match on this line would only touch lines that one
+        // starting on the next line does, or so we assume.
+        const auto nl = view.find('\n', start);
+        pos = nl == view.npos ? view.size() + 1 : nl + 1;
+      }
+      else {
+        pos = end;
+      }
     }
+    add_through(after_until, true);
+    return counts;
+  }
 
+  // Formats scratch.matches, or for -c the number of hits, into scratch.out
+  // and hands that to the writer.  With --quiet, stops the search instead.
+  // Called again for the same file, as a live stream is, it carries on where
+  // it left off.
+  void print(Scratch& scratch, uint8_t max_width, size_t hits) {
+    StatTimer t(scratch.timer(&Stats::output_ns));
     const auto bold_on = state.opts.stdout_is_tty ? BOLD_ON : ""sv;
     const auto bold_off = state.opts.stdout_is_tty ? BOLD_OFF : ""sv;
-
-    std::lock_guard lk(io_mutex);
-    if (state.matched_one.test_and_set() && !state.opts.lflag
-        && !state.opts.count) {
-      mPrintLn("");
-    }
-    if (state.opts.lflag) {
-      mPrintLn("{}", pretty_path());
+    const auto& matches = scratch.matches;
+    auto& out = scratch.out;
+    out.clear();
+    const bool separate = !state.opts.lflag && !state.opts.count
+        && !state.opts.json && !printed_line;
+    // Set once a big block has started going out in pieces.
+    bool begun = false;
+    auto spill = [&] {
+      if (out.view().size() >= Output::BUFFER_SIZE && !node) {
+        if (!begun) {
+          state.out.begin(separate);
+          begun = true;
+        }
+        state.out.append(out.view());
+        out.clear();
+      }
+    };
+    state.matched_one.test_and_set();
+    if (state.opts.quiet) {
+      state.queue.cancel();
       return;
     }
-    if (state.opts.count) {
-      mPrintLn("{}{}{}:{}", bold_on, pretty_path(), bold_off, matches.size());
-      return;
+    const auto path = pretty_path(scratch.path);
+    if (state.opts.json) {
+      if (state.opts.lflag || state.opts.count) {
+        out.append(R"({"type":"file","path":)");
+        out.json(path);
+        if (state.opts.count) {
+          out.print(R"(,"count":{})", hits);
+        }
+        out.append("}\n");
+      }
+      auto span = 0uz;
+      for (const auto& m: matches) {
+        out.append(m.is_context ? R"({"type":"context","path":)"
+                                : R"({"type":"match","path":)");
+        out.json(path);
+        out.append(R"(,"line":)");
+        out.number(m.line);
+        out.append(R"(,"offset":)");
+        out.number(m.offset);
+        out.append(R"(,"text":)");
+        out.json(m.text);
+        if (m.truncated) {
+          out.append(R"(,"truncated":true)");
+        }
+        if (!m.is_context) {
+          append_submatches(scratch, m, span);
+        }
+        if (!m.is_context && state.opts.show_pattern) {
+          out.append(R"(,"patterns":[)");
+          state.expr.which(m.text, scratch.pattern_ids);
+          auto sep = ""sv;
+          for (const auto id: scratch.pattern_ids) {
+            out.print("{}{}", std::exchange(sep, ","sv), id);
+          }
+          out.push_back(']');
+        }
+        out.append("}\n");
+        spill();
+      }
     }
-    mPrintLn("{}{}{}", bold_on, pretty_path(), bold_off);
-    if (matches.size()) {
-      auto last_line = 0uz;
-      for (auto [line, text, truncated, is_context]: matches) {
+    else if (state.opts.lflag) {
+      out.append(path);
+      out.push_back(state.opts.null ? '\0' : '\n');
+    }
+    else if (state.opts.count) {
+      out.println("{}{}{}{}{}", bold_on, path, bold_off,
+                  state.opts.null ? '\0' : ':', hits);
+    }
+    else {
+      if (!printed_line) {
+        out.println("{}{}{}", bold_on, path, bold_off);
+      }
+      auto& last_line = printed_line;
+      for (auto [line, text, truncated, is_context, _]: matches) {
         if ((state.opts.before_context || state.opts.after_context)
             && last_line && line != last_line + 1) {
-          mPrintLn("--");
+          out.println("--");
         }
         last_line = line;
         static const auto ellipses = reinterpret_cast<const char*>(u8"…");
@@ -233,40 +1336,104 @@ class SearchJob : public Job {
         const auto pre_trunc = truncated ? bold_on : ""sv;
         const auto post_trunc = truncated ? bold_off : ""sv;
         const auto trunc = truncated ? ellipses : "";
-        mPrintLn("{}{:{}}{}" "{}{}" "{}{}{}",
-                 pre_line, line, max_width, post_line,
-                 delim, text,
-                 pre_trunc, trunc, post_trunc);
+        if (state.opts.show_pattern) {
+          auto& ids = scratch.ids;
+          ids.clear();
+          if (!is_context) {
+            state.expr.which(text, scratch.pattern_ids);
+            for (const auto id: scratch.pattern_ids) {
+              std::format_to(std::back_inserter(ids), "{}{}",
+                             ids.empty() ? "" : ",", id);
+            }
+          }
+          out.println("{}{:{}}{}" "{}{}{}" "{}{}{}{}",
+                      pre_line, line, max_width, post_line,
+                      delim, ids, delim, text,
+                      pre_trunc, trunc, post_trunc);
+        }
+        else {
+          out.println("{}{:{}}{}" "{}{}" "{}{}{}",
+                      pre_line, line, max_width, post_line,
+                      delim, text,
+                      pre_trunc, trunc, post_trunc);
+        }
+        spill();
+      }
+    }
+    if (begun) {
+      state.out.append(out.view());
+      state.out.end();
+    }
+    else if (node) {
+      state.order->put(std::exchange(node, nullptr), out.view(), separate);
+    }
+    else if (!out.view().empty()) {
+      state.out.write(out.view(), separate);
+    }
+    if (live) {
+      state.out.flush();
+    }
+  }
+
+  // Adds the "submatches" of a matching line for --json: where in the line
+  // each match starts and ends.  With --multiline those come from the spans
+  // scan_multiline() found, from `span` on, clipped to the line.
+  void append_submatches(Scratch& scratch, const Match& m, size_t& span) {
+    auto& out = scratch.out;
+    out.append(R"(,"submatches":[)");
+    auto sep = ""sv;
+    auto add = [&](size_t start, size_t end) {
+      out.append(std::exchange(sep, ","sv));
+      out.push_back('[');
+      out.number(start);
+      out.push_back(',');
+      out.number(end);
+      out.push_back(']');
+    };
+    if (state.opts.multiline) {
+      const auto& spans = scratch.spans;
+      const auto begin = m.offset;
+      const auto end = begin + m.text.size();
+      // Those that end before the line starts are done with.
+      while (span < spans.size()
+             && (spans[span].second < begin
+                 || (spans[span].second == begin
+                     && spans[span].first < begin))) {
+        ++span;
+      }
+      for (auto i = span; i < spans.size() && spans[i].first <= end; ++i) {
+        add(std::max(spans[i].first, begin) - begin,
+            std::min(spans[i].second, end) - begin);
+      }
+    }
+    else if (const auto literal = state.expr.required();
+             state.expr.just_literal()) {
+      for (auto pos = find_literal(m.text, literal); pos != m.text.npos;
+           pos = find_literal(m.text, literal, pos + literal.size())) {
+        add(pos, pos + literal.size());
       }
     }
     else {
-      mPrintLn("(file matched, but no lines matched)");
-    }
-  }
-
-  std::string_view truncate_span(std::string_view view, size_t end) {
-    if (state.opts.llflag || end <= 2048uz) {
-      return std::string_view(view.begin(), end);
-    }
-    std::string_view ret(view.begin(), 2048uz);
-    // try to truncate to the nearest UTF-8 code point
-    auto it = std::rbegin(ret);
-    int i = 0;
-    // scan until we're at something that is not a utf8-tail
-    for (; i < 4 && (*it & 0xc0) == 0x80; ++it, ++i) { }
-    static constexpr std::array<std::pair<uint8_t, uint8_t>, 5> mask_check {{
-      {0x80, 0},      // 1 from end: must be ASCII
-      {0xe0, 0xc0},   // 2 from end: ok if it's a 2-byte code point
-      {0xf0, 0xe0},   // 3 from end
-      {0xf8, 0xf0},   // 4 from end
-      {0, 0},         // 5? TODO(display): not valid utf8; passthru
-    }};
-    assert(i < 5);
-    auto [mask, check] = mask_check[i];
-    if ((*it & mask) != check) {
-      ret.remove_suffix(i + 1);
+      const auto& re = *state.expr.copy_to(scratch.re).expr;
+      const auto text = to_absl(m.text);
+      for (auto pos = 0uz; pos <= text.size(); ) {
+        absl::string_view found;
+        // The literal is much cheaper to look for, and there's no match
+        // without it.
+        if ((pos && !literal.empty()
+             && find_literal(m.text, literal, pos) == m.text.npos)
+            || !re.Match(text, pos, text.size(), RE2::UNANCHORED, &found, 1)) {
+          break;
+        }
+        const size_t start = found.data() - text.data();
+        const auto end = start + found.size();
+        add(start, end);
+        // Past an empty match, to the next code point.
+        for (pos = end + (start == end);
+             pos < text.size() && (text[pos] & 0xc0) == 0x80; ++pos) {}
+      }
     }
-    return ret;
+    out.push_back(']');
   }
 
   size_t calcWidth(size_t n) {
@@ -294,94 +1461,492 @@ class SearchJob : public Job {
     return 8;
   }
 
-  std::string pretty_path() const {
-    if (*std::begin(path) == ".") {
-      // XX surprisingly painful.... we don't want relative() since it
-      // canonicalizes symlinks
-      auto it = ++std::begin(path);
-      fs::path q(*it++);
-      for (; it != std::end(path); ++it) {
-        q /= *it;
+  std::string path() const {
+    return dir ? join(dir->path, name)
+        : std::string(from_stdin() ? STDIN_PATH : name);
+  }
+
+  // Returns path() without any leading ./, built in out.
+  std::string_view pretty_path(std::string& out) const {
+    out.clear();
+    if (from_stdin()) {
+      out = STDIN_PATH;
+      return out;
+    }
+    if (dir) {
+      out = dir->path;
+      if (!out.ends_with('/')) {
+        out += '/';
+      }
+    }
+    out += name;
+    if (!out.starts_with("./")) {
+      return out;
+    }
+    // XX surprisingly painful.... we don't want relative() since it
+    // canonicalizes symlinks.  Joining the components is the same as
+    // collapsing runs of separators.
+    auto w = 0uz;
+    for (auto r = std::min(out.find_first_not_of('/', 1), out.size());
+         r < out.size(); ++r) {
+      if (out[r] != '/' || out[w - 1] != '/') {
+        out[w++] = out[r];
       }
-      return q.string();
     }
-    return path.string();
+    out.resize(w);
+    return out;
   }
 
   GlobalState& state;
-  fs::path path;
+  const std::shared_ptr<const Dir> dir;
+  std::string names;
+  std::vector<OrderedOutput::Node*> nodes;
+  // The file being searched, and where the name after it starts.
+  std::string_view name;
+  // Its node, until its output is in.
+  OrderedOutput::Node* node = nullptr;
+  // Whether it's a pipe, whose matches get printed as they're found.
+  bool live = false;
+  // Whether to add what it holds to the cache, under cache_key.
+  bool caching = false;
+  uint64_t cache_key = 0;
+  // The last line printed of it, if any.
+  size_t printed_line = 0;
+  size_t next = 0;
+  // Which file of the batch it is.
+  size_t file = 0;
+  // Files the job these names came from had started on, from the first.
+  std::vector<Prefetcher::Handoff> handed;
+  // Whether the Prefetcher has the rest.
+  bool prefetching = false;
+  size_t bytes = 0;
+  const std::shared_ptr<SplitFile> split;
+  const size_t range = 0;
 };
 
+// Walks a path from the command line, or a directory entry that isn't known
+// to be a plain file.  Entries that are get batched into SearchJobs.
 class AddPathsJob : public Job {
  public:
-  AddPathsJob(GlobalState& state, auto&& path, bool requested,
-              std::optional<fs::file_status> ss_ = std::nullopt)
-      : state(state), path(FWD(path)), requested(requested), ss_(ss_) {}
+  // With --sort, node is where the output goes.
+  AddPathsJob(GlobalState& state, auto&& path, OrderedOutput::Node* node)
+      : state(state), name(FWD(path)), type(DT_UNKNOWN), node(node) {}
+
+  AddPathsJob(GlobalState& state, std::shared_ptr<const Dir> dir,
+              auto&& name, unsigned char type, OrderedOutput::Node* node)
+      : state(state), dir(std::move(dir)), name(FWD(name)), type(type),
+        node(node) {}
+
+  // The entries of a directory still to push, from one that yielded to the
+  // backlog.
+  struct Rest {
+    std::shared_ptr<const Dir> dir;
+    std::string names;
+    std::vector<std::pair<size_t, unsigned char>> entries;
+    size_t next = 0;
+    OrderedOutput::Node* node = nullptr;
+  };
 
-  void operator()() override {
+  AddPathsJob(GlobalState& state, std::unique_ptr<Rest> rest)
+      : state(state), name(rest->dir->path), type(DT_DIR),
+        node(rest->node), rest(std::move(rest)) {}
+
+  // With --sort it goes in with the searches, since the worker putting off
+  // a subdirectory until it's searched the files after it would hold up
+  // what's in the subdirectory.
+  bool expands() const noexcept override {
+    return !state.order;
+  }
+
+  void operator()(Scratch& scratch) override {
     try {
-      run_unchecked();
+      run_unchecked(scratch);
     }
-    catch (const fs::filesystem_error& e) {
+    catch (const std::system_error& e) {
       mPrintLn(std::cerr,
-               "Skipping {}: error: {}", path.string(), e.code().message());
+               "Skipping {}: error: {}", path(), e.code().message());
     }
     catch (const std::exception& e) {
       mPrintLn(std::cerr,
-               "Unexpected exception on {}: {}", path.string(), e.what());
+               "Unexpected exception on {}: {}", path(), e.what());
       throw;
     }
+    // Unless it went to another job, there's nothing more to come of it.
+    if (node) {
+      state.order->finish(node);
+    }
   }
 
  private:
-  void run_unchecked() {
-    if (!requested && is_ignored()) {
+  void run_unchecked(Scratch& scratch) {
+    if (rest) {
+      auto& r = *rest;
+      r.next = push_entries(r.dir, r.names, r.entries, r.next, scratch);
+      if (r.next < r.entries.size()) {
+        node = nullptr;
+        state.queue.yield(std::make_unique<AddPathsJob>(state,
+                                                        std::move(rest)));
+      }
       return;
     }
-    auto s = ss_.value_or(fs::status(path));
-    if (fs::is_regular_file(s)) {
-      if (0 == access(path.c_str(), R_OK)) {
-        state.queue.push(std::make_unique<SearchJob>(state, path));
+    const int at = dir ? dir->fd : AT_FDCWD;
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+      // Follows symlinks, so links to directories get walked too.
+      struct stat st;
+      if (StatTimer t(scratch.timer(&Stats::stat_ns));
+          fstatat(at, name.c_str(), &st, 0)) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+          mPrintLn(std::cerr, "Skipping {}: nonexistent", path());
+          return;
+        }
+        throw std::system_error(errno, std::generic_category(), "stat");
+      }
+      // A pipe or device named on the command line gets read like a file,
+      // but not one come across on the walk.
+      type = S_ISREG(st.st_mode) || (!dir && !S_ISDIR(st.st_mode)) ? DT_REG
+          : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+      if ((type == DT_REG || type == DT_DIR) && dir && dir->ignore
+          && dir->ignore->ignored(dir->path, name, type == DT_DIR)) {
+        return;
+      }
+      if (state.filter && (type == DT_REG || type == DT_DIR)
+          && !wanted(dir.get(), name.c_str(), type, &st, scratch)) {
+        return;
+      }
+    }
+    if (type == DT_REG) {
+      std::vector<OrderedOutput::Node*> nodes;
+      if (node) {
+        nodes.push_back(std::exchange(node, nullptr));
+      }
+      state.queue.push(
+          std::make_unique<SearchJob>(state, dir, name, std::move(nodes)));
+    }
+    else if (type == DT_DIR) {
+      auto sub = read_dir(at, scratch);
+      if (node) {
+        state.order->open(node);
+      }
+      const auto& entries = scratch.entries;
+      const auto next = push_entries(sub, scratch.entry_names, entries, 0,
+                                     scratch);
+      if (next < entries.size()) {
+        state.queue.yield(std::make_unique<AddPathsJob>(
+            state, std::make_unique<Rest>(
+                sub, scratch.entry_names,
+                std::vector(entries.begin() + next, entries.end()), 0,
+                std::exchange(node, nullptr))));
+      }
+    }
+  }
+
+  // Pushes jobs for the entries of sub from next on, stopping early if that
+  // leaves the queue backlogged.  Returns where it stopped.
+  //
+  // With --sort, each entry gets a node under this one, and the jobs are
+  // pushed at the end and last first, so that this worker, taking the last
+  // pushed first, gets to them in order.
+  size_t push_entries(
+      const std::shared_ptr<const Dir>& sub, const std::string& names,
+      const std::vector<std::pair<size_t, unsigned char>>& entries,
+      size_t next, Scratch& scratch) {
+    const auto& ignore = sub->ignore;
+    std::vector<std::unique_ptr<Job>> jobs;
+    auto push = [&](std::unique_ptr<Job> job) {
+      if (node) {
+        jobs.push_back(std::move(job));
+      }
+      else {
+        state.queue.push(std::move(job));
+      }
+    };
+    std::string batch;
+    std::vector<OrderedOutput::Node*> nodes;
+    auto batched = 0uz;
+    auto flush = [&] {
+      push(std::make_unique<SearchJob>(state, sub, std::move(batch),
+                                       std::move(nodes)));
+      batch.clear();
+      nodes.clear();
+      batched = 0;
+    };
+    for (; next < entries.size(); ++next) {
+      const auto [offset, d_type] = entries[next];
+      const DirReader::Entry entry{names.data() + offset, d_type};
+      if ((entry.type == DT_REG || entry.type == DT_DIR) && ignore
+          && ignore->ignored(sub->path, entry.name, entry.type == DT_DIR)) {
+        continue;
+      }
+      if (state.filter && (entry.type == DT_REG || entry.type == DT_DIR)
+          && !wanted(sub.get(), entry.name, entry.type, nullptr, scratch)) {
+        continue;
+      }
+      if (entry.type == DT_REG) {
+        if (batched++) {
+          batch += '\0';
+        }
+        batch += entry.name;
+        if (node) {
+          nodes.push_back(state.order->add(node));
+        }
+        if (batched < SearchJob::BATCH_FILES) {
+          continue;
+        }
+        flush();
+      }
+      else if (entry.type == DT_DIR || entry.type == DT_LNK
+               || entry.type == DT_UNKNOWN) {
+        push(std::make_unique<AddPathsJob>(
+            state, sub, entry.name, entry.type,
+            node ? state.order->add(node) : nullptr));
       }
       else {
-        mPrintLn(std::cerr, "Skipping {}: Permission denied", path.string());
+        continue;
+      }
+      if (state.queue.backlogged(jobs.size())) {
+        ++next;
+        break;
       }
     }
-    else if (fs::is_directory(s)) {
-      for (auto it{fs::directory_iterator(path)};
-           it != fs::directory_iterator(); ++it) {
-        auto itS = it->status();
-        state.queue.push(
-            std::make_unique<AddPathsJob>(
-                state, std::move(*it), false, std::move(itS)));
+    if (batched) {
+      flush();
+    }
+    for (auto& job: jobs | std::views::reverse) {
+      state.queue.push(std::move(job));
+    }
+    return next;
+  }
+
+  // Opens and reads the directory, leaving its entries other than hidden
+  // ones in scratch.  They're read in full first, since the ignore files
+  // among them apply to the rest.
+  std::shared_ptr<const Dir> read_dir(int at, Scratch& scratch) {
+    auto sub = std::make_shared<Dir>(at, name.c_str(), path());
+    auto& names = scratch.entry_names;
+    auto& entries = scratch.entries;
+    names.clear();
+    entries.clear();
+    bool gitignore = false;
+    bool ignore = false;
+    ++scratch.stats.dirs;
+    {
+      StatTimer t(scratch.timer(&Stats::readdir_ns));
+      DirReader reader(*sub, scratch.dirents);
+      for (DirReader::Entry entry; reader.next(entry); ) {
+        const std::string_view n = entry.name;
+        gitignore |= n == ".gitignore";
+        ignore |= n == ".ignore";
+        if (is_hidden(n)) {
+          continue;
+        }
+        entries.emplace_back(names.size(), entry.type);
+        names += n;
+        names += '\0';
+      }
+    }
+    if (state.order) {
+      std::ranges::sort(entries, [&](const auto& a, const auto& b) {
+        return std::string_view(names.data() + a.first)
+            < std::string_view(names.data() + b.first);
+      });
+    }
+    if (dir) {
+      sub->ignore = dir->ignore;
+    }
+    if (!state.opts.no_ignore && (gitignore || ignore)) {
+      std::string text;
+      for (auto [file, present]: {std::pair{".gitignore", gitignore},
+                                  std::pair{".ignore", ignore}}) {
+        if (!present) {
+          continue;
+        }
+        try {
+          FileContents contents(sub->fd, file, scratch.file);
+          text += contents.view();
+          text += '\n';
+        }
+        catch (const std::system_error& e) {
+          mPrintLn(std::cerr,
+                   "Skipping {}: error: {}", join(sub->path, file),
+                   e.code().message());
+        }
       }
+      sub->ignore = IgnoreRules::compile(sub->ignore, sub->path, text);
+    }
+    return sub;
+  }
+
+  // Whether -t, -g and --max-filesize leave in the file or directory name in
+  // sub, or if sub is null, the one named on the command line, which only
+  // the size counts against.  st is its stat if that's been got already, and
+  // otherwise it's only got if the size matters.
+  bool wanted(const Dir* sub, const char* name, unsigned char type,
+              const struct stat* st, Scratch& scratch) const {
+    const auto& filter = *state.filter;
+    if (type == DT_DIR) {
+      return !sub || filter.wants_dir(sub->path, name);
+    }
+    if (sub && !filter.wants_file(sub->path, name)) {
+      return false;
     }
-    else if (!fs::exists(s)) {
-      mPrintLn(std::cerr, "Skipping {}: nonexistent", path.string());
+    if (!filter.checks_size()) {
+      return true;
     }
+    struct stat own;
+    if (!st) {
+      StatTimer t(scratch.timer(&Stats::stat_ns));
+      if (fstatat(sub->fd, name, &own, AT_SYMLINK_NOFOLLOW)) {
+        // The search can say what's wrong with it.
+        return true;
+      }
+      st = &own;
+    }
+    return !S_ISREG(st->st_mode) || filter.wants_size(st->st_size);
+  }
+
+  std::string path() const {
+    return dir ? join(dir->path, name) : name;
   }
 
-  bool is_ignored() const {
-    auto name = path.filename().string();
-    return name != "." && name != ".." && name.starts_with('.');
+  static bool is_hidden(std::string_view name) {
+    return name.starts_with('.');
   }
 
   GlobalState& state;
-  const fs::path path;
-  const bool requested;
-  const std::optional<fs::file_status> ss_;
+  const std::shared_ptr<const Dir> dir;
+  const std::string name;
+  unsigned char type;
+  // With --sort, until it's handed on or finished.
+  OrderedOutput::Node* node = nullptr;
+  std::unique_ptr<Rest> rest;
 };
 
+// Every directory with entries still queued holds an fd, and a wide tree can
+// have a lot of those.
+void raise_fd_limit() {
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    (void)setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+// Whether, given no paths, to search standard input rather than the working
+// directory: it's a pipe, and not already read for -f.  Anything else may
+// just be what cron, CI or find -exec left there, so a file or a socket has
+// to be asked for with -.
+bool stdin_has_input(const Opts& opts) {
+  struct stat st;
+  return !opts.patterns_from_stdin && !fstat(STDIN_FILENO, &st)
+      && S_ISFIFO(st.st_mode);
+}
+
+// Returns the index at path, or null if there isn't one that can be used.
+std::unique_ptr<const Index> load_index(std::string_view path) {
+  const std::string p(path);
+  try {
+    return std::make_unique<Index>(p.c_str());
+  }
+  catch (const std::system_error& e) {
+    if (e.code() != std::errc::no_such_file_or_directory) {
+      mPrintLn(std::cerr, "Not using index {}: {}", p, e.code().message());
+    }
+  }
+  catch (const std::runtime_error& e) {
+    mPrintLn(std::cerr, "Not using index {}: {}", p, e.what());
+  }
+  return nullptr;
+}
+
+// Loads the index for a search, unless every pattern might match a file
+// without having any trigram in particular.
+void open_index(GlobalState& state) {
+  if (!state.expr.case_sensitive()) {
+    // The trigrams are as they are in the files.
+    return;
+  }
+  std::vector<std::vector<uint32_t>> alternatives;
+  for (const auto& p: state.opts.patterns) {
+    alternatives.push_back(
+        trigrams_of(state.opts.qflag ? p : required_literal(p)));
+    if (alternatives.back().empty()) {
+      return;
+    }
+  }
+  if (state.opts.binary_sniff < BINARY_HEAD) {
+    // The index leaves out what its first BINARY_HEAD bytes say is binary.
+    return;
+  }
+  if (state.opts.search_zip) {
+    // And it has compressed files as they are on disk, which is binary.
+    return;
+  }
+  state.index = load_index(state.opts.index_file);
+  if (state.index) {
+    state.candidates = state.index->candidates(alternatives);
+  }
+}
+
+// Maps the cache for --cache, keyed on everything that decides what a file
+// comes to, or goes without.
+void open_cache(GlobalState& state) {
+  const auto path = ResultCache::default_path();
+  if (path.empty()) {
+    mPrintLn(std::cerr, "Not using cache: no $XDG_CACHE_HOME or $HOME");
+    return;
+  }
+  const auto& o = state.opts;
+  // Without --long-lines, what's matched is the line as it's cut short.
+  auto query = ResultCache::hash(std::format(
+      "{} {:d} {:d} {:d} {:d} {} {:d}", VERSION, state.expr.case_sensitive(),
+      o.qflag, o.multiline, o.llflag, o.binary_sniff, o.search_zip));
+  for (const auto& p: o.patterns) {
+    // Chained, so that where one pattern ends and the next starts counts.
+    query = ResultCache::hash(p, query);
+  }
+  try {
+    state.cache = std::make_unique<ResultCache>(path, query);
+  }
+  catch (const std::system_error& e) {
+    mPrintLn(std::cerr, "Not using cache {}: {}", path, e.code().message());
+  }
+}
+
 struct JobRunner {
-  explicit JobRunner(WorkQueue& queue): queue(queue) {}
+  JobRunner(GlobalState& state, size_t worker)
+      : state(state), worker(worker) {}
 
   void operator()() {
-    queue.runUntilEmpty();
+    if (state.topology) {
+      // Before scratch gets any memory, so that it's on this CPU's node.
+      Topology::pin(state.topology->cpu_for(worker).id);
+    }
+    if (state.order) {
+      state.order->add_worker();
+    }
+    Scratch scratch(state.opts);
+    state.queue.runUntilEmpty(worker, scratch);
+    if (state.opts.stats) {
+      state.stats[worker] = scratch.stats;
+    }
   }
 
-  WorkQueue& queue;
+  GlobalState& state;
+  const size_t worker;
 };
 
+// Sums up what the workers counted, for --stats.
+void report_stats(const GlobalState& state, uint64_t start) {
+  Stats total;
+  for (auto i = 0uz; i < state.stats.size(); ++i) {
+    total += state.stats[i];
+    total.wait_ns += state.queue.idle_ns(i);
+  }
+  total.peak_jobs = state.queue.peak_pending();
+  total.wall_ns = stat_clock() - start;
+  mPrint(std::cerr, "{}", total.format(state.opts.stats_json));
+}
+
 }   // namespace
 
 int main(int const argc, char const* argv[]) {
@@ -399,25 +1964,148 @@ int main(int const argc, char const* argv[]) {
   if (opts->version) {
     version();
   }
-  const auto nThreads = std::thread::hardware_concurrency();
+  if (opts->type_list) {
+    type_list();
+  }
+  const auto start = stat_clock();
+  std::ios_base::sync_with_stdio(false);
+  raise_fd_limit();
+  auto topology = opts->pin_threads ? std::make_unique<const Topology>()
+                                    : nullptr;
+  if (topology && topology->empty()) {
+    mPrintLn(std::cerr, "{}: can't pin threads here", opts->argv0);
+    topology.reset();
+  }
+  const auto nThreads = opts->threads ? opts->threads
+                                      : Topology::available_cpus();
+  std::vector<unsigned> nodes;
+  for (auto i = 0uz; topology && i < nThreads; ++i) {
+    nodes.push_back(topology->cpu_for(i).node);
+  }
   auto options = RE2::Options();
   options.set_literal(opts->qflag);
-  const auto pattern = opts->pattern;
-  auto state = GlobalState{std::move(*opts), SyncedRe(pattern, options), {}};
+  if (opts->patterns.empty() && !opts->index) {
+    // -f on an empty file: nothing can match.
+    return 1;
+  }
+  const auto upper = [&](const auto& p) { return has_upper(p, opts->qflag); };
+  if (opts->ignore_case
+      || (opts->smart_case && std::ranges::none_of(opts->patterns, upper))) {
+    // Much cheaper than folding the input.
+    options.set_case_sensitive(false);
+  }
+  if (opts->regex_mem) {
+    options.set_max_mem(
+        std::min<int64_t>(opts->regex_mem, INT64_MAX >> 20) << 20);
+  }
+  else {
+    // Big alternations outgrow the default, and the DFA falls back on the
+    // much slower NFA whenever its cache fills.
+    options.set_max_mem(std::max<int64_t>(
+        options.max_mem(), static_cast<int64_t>(opts->patterns.size()) << 16));
+  }
+  auto patterns = opts->patterns;
+  const bool tty = opts->stdout_is_tty;
+  const bool multiline = opts->multiline;
+  const bool show_pattern = opts->show_pattern;
+  const bool stats = opts->stats;
+  auto state = GlobalState{std::move(*opts),
+                           SyncedRe(std::move(patterns), options, multiline,
+                                    show_pattern),
+                           WorkQueue(nThreads, nodes, stats),
+                           Output(STDOUT_FILENO, tty)};
   opts.reset();
+  state.topology = std::move(topology);
+  if (!state.opts.types.empty() || !state.opts.globs.empty()
+      || state.opts.max_filesize != SIZE_MAX) {
+    try {
+      state.filter = std::make_unique<const FileFilter>(
+          state.opts.types, state.opts.globs, state.opts.max_filesize);
+    }
+    catch (const std::invalid_argument& e) {
+      mPrintLn(std::cerr, "{}: {}", state.opts.argv0, e.what());
+      return 2;
+    }
+  }
+  if (state.opts.index) {
+    state.index_writer = std::make_unique<IndexWriter>(
+        std::string(state.opts.index_file),
+        load_index(state.opts.index_file));
+  }
+  else if (!state.opts.no_index) {
+    open_index(state);
+  }
+  if (state.opts.cache && !state.index_writer) {
+    open_cache(state);
+  }
+  if (state.opts.stats) {
+    state.stats.resize(nThreads);
+  }
+  if (state.opts.sort && !state.index_writer) {
+    state.order = std::make_unique<OrderedOutput>(state.out);
+  }
+  const auto root = [&] {
+    return state.order ? state.order->add(state.order->root()) : nullptr;
+  };
+  // Workers are started as there's work for them, so that a search of a
+  // few files doesn't wait on starting a thread for every core.
+  std::mutex threads_m;
+  std::vector<std::thread> threads;
+  bool closed = false;
+  state.queue.start_lazily([&](size_t worker) {
+    std::lock_guard lk(threads_m);
+    if (!closed) {
+      threads.emplace_back(JobRunner(state, worker));
+    }
+  });
+  const auto push_path = [&](std::string_view path) {
+    if (path != SearchJob::STDIN) {
+      state.queue.push(std::make_unique<AddPathsJob>(state, path, root()));
+      return;
+    }
+    std::vector<OrderedOutput::Node*> nodes;
+    if (state.order) {
+      nodes.push_back(root());
+    }
+    state.queue.push(std::make_unique<SearchJob>(state, nullptr, path,
+                                                 std::move(nodes)));
+  };
   if (!state.opts.paths.size()) {
-    state.queue.push(std::make_unique<AddPathsJob>(state, ".", true));
+    push_path(state.index_writer || !stdin_has_input(state.opts)
+              ? "." : SearchJob::STDIN);
   }
   for (const auto path: state.opts.paths) {
-    state.queue.push(std::make_unique<AddPathsJob>(state, path, true));
+    push_path(path);
   }
-  state.queue.push(std::make_unique<CompileReJob>(state));
-  std::vector<std::thread> threads;
-  for (auto i = 0uz; i < nThreads; ++i) {
-    threads.emplace_back(JobRunner(state.queue));
+  if (state.order) {
+    state.order->finish(state.order->root());
+  }
+  if (!state.index_writer) {
+    // While the first worker gets on with the walk.
+    state.expr.init();
+  }
+  // This thread is worker 0.
+  JobRunner(state, 0)();
+  {
+    std::lock_guard lk(threads_m);
+    closed = true;
   }
   for (auto& thread: threads) {
     thread.join();
   }
+  state.out.flush();
+  if (state.opts.stats) {
+    report_stats(state, start);
+  }
+  if (state.index_writer) {
+    try {
+      state.index_writer->write();
+    }
+    catch (const std::system_error& e) {
+      mPrintLn(std::cerr, "Failed to write index: {}", e.what());
+      return 2;
+    }
+    return 0;
+  }
   return state.matched_one.test() ? 0 : 1;
 }
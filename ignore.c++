@@ -0,0 +1,176 @@
+#include "ignore.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "dir.h"
+
+namespace {
+
+void add_literal(std::string& re, char c) {
+  const auto u = static_cast<unsigned char>(c);
+  if (!(u & 0x80) && !('0' <= c && c <= '9') && !('a' <= c && c <= 'z')
+      && !('A' <= c && c <= 'Z') && c != '_') {
+    re += '\\';
+  }
+  re += c;
+}
+
+}   // namespace
+
+RE2::Options glob_set_options() {
+  RE2::Options options;
+  // File names are bytes, not necessarily UTF-8.
+  options.set_encoding(RE2::Options::EncodingLatin1);
+  options.set_log_errors(false);
+  return options;
+}
+
+std::string glob_to_regexp(std::string_view glob, bool anchored) {
+  std::string re = anchored ? "" : "(?:.*/)?";
+  for (auto i = 0uz; i < glob.size(); ) {
+    const auto rest = glob.substr(i);
+    const bool at_start = i == 0 || glob[i - 1] == '/';
+    if (at_start && rest.starts_with("**/")) {
+      re += "(?:.*/)?";
+      i += 3;
+    }
+    else if (at_start && rest == "**") {
+      re += ".*";
+      i += 2;
+    }
+    else if (rest[0] == '*') {
+      re += "[^/]*";
+      ++i;
+    }
+    else if (rest[0] == '?') {
+      re += "[^/]";
+      ++i;
+    }
+    else if (rest[0] == '\\' && rest.size() > 1) {
+      add_literal(re, rest[1]);
+      i += 2;
+    }
+    else if (rest[0] == '[') {
+      // A class, with ! for negation; unterminated, it's just a bracket.
+      auto j = 1uz;
+      if (j < rest.size() && (rest[j] == '!' || rest[j] == '^')) {
+        ++j;
+      }
+      if (j < rest.size() && rest[j] == ']') {
+        ++j;
+      }
+      const auto close = rest.find(']', j);
+      if (close == rest.npos) {
+        add_literal(re, '[');
+        ++i;
+        continue;
+      }
+      re += '[';
+      auto k = 1uz;
+      if (rest[k] == '!' || rest[k] == '^') {
+        re += '^';
+        ++k;
+      }
+      for (; k < close; ++k) {
+        if (rest[k] == '\\' || rest[k] == '[') {
+          re += '\\';
+        }
+        re += rest[k];
+      }
+      re += ']';
+      i += close + 1;
+    }
+    else {
+      add_literal(re, rest[0]);
+      ++i;
+    }
+  }
+  return re;
+}
+
+IgnoreRules::IgnoreRules(std::shared_ptr<const IgnoreRules> parent,
+                         std::string path)
+    : parent(std::move(parent)), path(std::move(path)),
+      set(glob_set_options(), RE2::ANCHOR_BOTH) {}
+
+std::shared_ptr<const IgnoreRules> IgnoreRules::compile(
+    std::shared_ptr<const IgnoreRules> parent, std::string_view path,
+    std::string_view text) {
+  auto rules = std::make_shared<IgnoreRules>(parent, std::string(path));
+  while (text.size()) {
+    const auto eol = std::min(text.find('\n'), text.size());
+    rules->add(text.substr(0, eol));
+    text.remove_prefix(std::min(eol + 1, text.size()));
+  }
+  if (rules->patterns.empty() || !rules->set.Compile()) {
+    return parent;
+  }
+  return rules;
+}
+
+void IgnoreRules::add(std::string_view line) {
+  if (line.ends_with('\r')) {
+    line.remove_suffix(1);
+  }
+  // Trailing spaces don't count unless escaped.
+  while (line.ends_with(' ')
+         && !(line.size() > 1 && line[line.size() - 2] == '\\')) {
+    line.remove_suffix(1);
+  }
+  if (line.empty() || line.starts_with('#')) {
+    return;
+  }
+  Pattern p{false, false};
+  if (line.starts_with('!')) {
+    p.negated = true;
+    line.remove_prefix(1);
+  }
+  else if (line.starts_with("\\!") || line.starts_with("\\#")) {
+    line.remove_prefix(1);
+  }
+  if (line.ends_with('/')) {
+    p.dir_only = true;
+    line.remove_suffix(1);
+  }
+  // A slash anywhere but the end anchors the pattern to this directory.
+  const bool anchored = line.contains('/');
+  if (line.starts_with('/')) {
+    line.remove_prefix(1);
+  }
+  if (line.empty()) {
+    return;
+  }
+  if (set.Add(to_absl(glob_to_regexp(line, anchored)), nullptr) >= 0) {
+    patterns.push_back(p);
+  }
+}
+
+bool IgnoreRules::ignored(std::string_view dir_path, std::string_view name,
+                          bool is_dir) const {
+  thread_local std::vector<int> hits;
+  thread_local std::string rel;
+  for (auto rules = this; rules; rules = rules->parent.get()) {
+    // dir_path is rules->path, or under it: the rest is what the patterns
+    // see, joined to name.
+    auto sub = dir_path.substr(std::min(rules->path.size(), dir_path.size()));
+    while (sub.starts_with('/')) {
+      sub.remove_prefix(1);
+    }
+    join_to(rel, sub, name);
+    hits.clear();
+    if (!rules->set.Match(to_absl(rel), &hits)) {
+      continue;
+    }
+    auto best = -1;
+    for (auto i: hits) {
+      if (i > best && (is_dir || !rules->patterns[i].dir_only)) {
+        best = i;
+      }
+    }
+    if (best >= 0) {
+      return !rules->patterns[best].negated;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <absl/strings/string_view.h>
+#include <re2/set.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+inline absl::string_view to_absl(std::string_view view) {
+  return absl::string_view(view.data(), view.size());
+}
+
+// Options for an RE2::Set of globs, matched against file names.
+RE2::Options glob_set_options();
+
+// Translates a gitignore glob, without its leading or trailing slash, into a
+// regexp for the path of a file relative to the directory it's in.  Unless
+// anchored, the file may be in a subdirectory of it.
+std::string glob_to_regexp(std::string_view glob, bool anchored);
+
+// The .gitignore and .ignore patterns from one directory, compiled into an
+// RE2::Set, along with those of the directories above it.  Shared read-only
+// between the jobs walking the directory and everything under it.
+class IgnoreRules {
+ public:
+  // Compiles the patterns in text, one per line, for the directory at path.
+  // Returns parent if there are none.
+  static std::shared_ptr<const IgnoreRules> compile(
+      std::shared_ptr<const IgnoreRules> parent, std::string_view path,
+      std::string_view text);
+
+  IgnoreRules(std::shared_ptr<const IgnoreRules> parent, std::string path);
+
+  // Whether an entry of the directory at dir_path, which this directory is or
+  // is under, is ignored.  The nearest directory with a pattern that matches
+  // decides, and within a directory the last pattern that matches does.
+  bool ignored(std::string_view dir_path, std::string_view name,
+               bool is_dir) const;
+
+ private:
+  struct Pattern {
+    bool negated;
+    bool dir_only;
+  };
+
+  // Adds a line of a .gitignore, unless it has no pattern or a bad one.
+  void add(std::string_view line);
+
+  const std::shared_ptr<const IgnoreRules> parent;
+  const std::string path;
+  RE2::Set set;
+  std::vector<Pattern> patterns;
+};
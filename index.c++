@@ -0,0 +1,538 @@
+#include "index.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <queue>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include "file.h"
+
+namespace {
+
+constexpr char MAGIC[8] = {'g', 'r', '-', 'i', 'd', 'x', '2', '\n'};
+
+[[noreturn]] void throw_errno(const char* what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+[[noreturn]] void not_an_index() {
+  throw std::runtime_error("not a gr index");
+}
+
+constexpr uint64_t align8(uint64_t n) {
+  return (n + 7) & ~7ull;
+}
+
+// Reads back one sorted run of postings, a block at a time.
+class RunReader {
+ public:
+  explicit RunReader(FILE* f): f(f) {
+    rewind(f);
+    refill();
+  }
+
+  // A sorted vector instead of a file.
+  explicit RunReader(const std::vector<uint64_t>& v)
+      : data(v.data()), end(v.data() + v.size()) {}
+
+  bool empty() const noexcept {
+    return data == end;
+  }
+
+  uint64_t front() const noexcept {
+    return *data;
+  }
+
+  void pop() {
+    if (++data == end && f) {
+      refill();
+    }
+  }
+
+ private:
+  void refill() {
+    const auto n = fread(buf.data(), sizeof(uint64_t), buf.size(), f);
+    if (!n && ferror(f)) {
+      throw_errno("read");
+    }
+    data = buf.data();
+    end = data + n;
+  }
+
+  FILE* f = nullptr;
+  std::vector<uint64_t> buf = std::vector<uint64_t>(f ? 1uz << 16 : 0);
+  const uint64_t* data = nullptr;
+  const uint64_t* end = nullptr;
+};
+
+// Writes to a FILE*, keeping track of the offset.
+class Writer {
+ public:
+  explicit Writer(FILE* f): f(f) {}
+
+  void put(const void* p, size_t n) {
+    if (n && fwrite(p, 1, n, f) != n) {
+      throw_errno("write");
+    }
+    pos += n;
+  }
+
+  void pad() {
+    static constexpr char zeros[8] = {};
+    put(zeros, align8(pos) - pos);
+  }
+
+  uint64_t offset() const noexcept {
+    return pos;
+  }
+
+ private:
+  FILE* const f;
+  uint64_t pos = 0;
+};
+
+// Sorts postings added in file order by trigram and then file id: a stable
+// sort by trigram alone is enough, and two radix passes beat std::sort.
+void sort_postings(std::vector<uint64_t>& v) {
+  constexpr int BITS = 12;
+  std::vector<uint64_t> tmp(v.size());
+  for (int shift: {32, 32 + BITS}) {
+    std::vector<size_t> start((1uz << BITS) + 1);
+    for (const auto p: v) {
+      ++start[((p >> shift) & ((1uz << BITS) - 1)) + 1];
+    }
+    for (auto i = 1uz; i < start.size(); ++i) {
+      start[i] += start[i - 1];
+    }
+    for (const auto p: v) {
+      tmp[start[(p >> shift) & ((1uz << BITS) - 1)]++] = p;
+    }
+    std::swap(v, tmp);
+  }
+}
+
+void put_varint(std::string& out, uint32_t n) {
+  while (n >= 0x80) {
+    out += static_cast<char>(n | 0x80);
+    n >>= 7;
+  }
+  out += static_cast<char>(n);
+}
+
+}   // namespace
+
+void TrigramSet::clear() noexcept {
+  for (const auto t: found) {
+    seen[t >> 6] = 0;
+  }
+  found.clear();
+}
+
+bool TrigramSet::add(std::string_view text) {
+  if (seen.empty()) {
+    seen.resize((1uz << 24) / 64);
+  }
+  if (found.size() > MAX_TRIGRAMS) {
+    return false;
+  }
+  if (text.size() < 3) {
+    return true;
+  }
+  const auto* p = reinterpret_cast<const unsigned char*>(text.data());
+  uint32_t t = (p[0] << 8) | p[1];
+  for (auto i = 2uz; i < text.size(); ++i) {
+    t = ((t << 8) | p[i]) & 0xffffff;
+    auto& word = seen[t >> 6];
+    const auto bit = 1ull << (t & 63);
+    if (!(word & bit)) {
+      word |= bit;
+      found.push_back(t);
+      if (found.size() > MAX_TRIGRAMS) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+std::vector<uint32_t> trigrams_of(std::string_view s) {
+  std::vector<uint32_t> ret;
+  const auto* p = reinterpret_cast<const unsigned char*>(s.data());
+  for (auto i = 2uz; i < s.size(); ++i) {
+    ret.push_back((p[i - 2] << 16) | (p[i - 1] << 8) | p[i]);
+  }
+  std::sort(ret.begin(), ret.end());
+  ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+  return ret;
+}
+
+IndexWriter::IndexWriter(std::string path, std::unique_ptr<const Index> base)
+    : path(std::move(path)), base(std::move(base)) {}
+
+IndexWriter::~IndexWriter() {
+  for (auto f: runs) {
+    fclose(f);
+  }
+}
+
+void IndexWriter::add(std::string_view path, const struct stat& st,
+                      uint32_t flags, const TrigramSet& set) {
+  std::vector<uint64_t> full;
+  {
+    std::lock_guard lk(m);
+    const uint64_t id = files.size();
+    files.push_back({mtime_ns(st), static_cast<uint64_t>(st.st_size),
+                     static_cast<uint64_t>(st.st_ino), names.size(), flags,
+                     0});
+    names += path;
+    names += '\0';
+    if (!flags) {
+      for (const auto t: set.trigrams()) {
+        postings.push_back(uint64_t(t) << 32 | id);
+      }
+    }
+    if (postings.size() >= SPILL_POSTINGS) {
+      std::swap(full, postings);
+    }
+  }
+  if (full.size()) {
+    spill(std::move(full));
+  }
+}
+
+bool IndexWriter::reuse(std::string_view path, const struct stat& st) {
+  if (!base) {
+    return false;
+  }
+  const auto id = base->find(path);
+  if (id == Index::npos || !base->fresh(id, st)) {
+    return false;
+  }
+  std::lock_guard lk(m);
+  reused.push_back(id);
+  return true;
+}
+
+void IndexWriter::spill(std::vector<uint64_t> run) {
+  sort_postings(run);
+  auto f = tmpfile();
+  if (!f) {
+    throw_errno("tmpfile");
+  }
+  {
+    std::lock_guard lk(spill_m);
+    runs.push_back(f);
+  }
+  if (fwrite(run.data(), sizeof(uint64_t), run.size(), f) != run.size()) {
+    throw_errno("write");
+  }
+}
+
+void IndexWriter::write() {
+  std::lock_guard lk(m);
+  sort_postings(postings);
+  const auto tmp = path + ".tmp";
+  auto f = fopen(tmp.c_str(), "wb");
+  if (!f) {
+    throw_errno(tmp.c_str());
+  }
+  try {
+    write_to(f);
+  }
+  catch (...) {
+    fclose(f);
+    unlink(tmp.c_str());
+    throw;
+  }
+  if (fclose(f) || rename(tmp.c_str(), path.c_str())) {
+    const auto saved = errno;
+    unlink(tmp.c_str());
+    errno = saved;
+    throw_errno(path.c_str());
+  }
+}
+
+void IndexWriter::write_to(FILE* f) {
+  // Kept files come first, in their old order, so that their old posting
+  // lists stay sorted when renumbered.  The new ones follow.
+  std::sort(reused.begin(), reused.end());
+  reused.erase(std::unique(reused.begin(), reused.end()), reused.end());
+  const uint32_t kept = reused.size();
+  std::vector<uint32_t> renumber(base ? base->size() : 0, UINT32_MAX);
+  std::vector<IndexFile> all;
+  std::string all_names;
+  for (auto i = 0u; i < kept; ++i) {
+    renumber[reused[i]] = i;
+    auto file = base->file(reused[i]);
+    const auto name = base->name(file);
+    file.name = all_names.size();
+    all_names += name;
+    all_names += '\0';
+    all.push_back(file);
+  }
+  const auto shift = all_names.size();
+  all_names += names;
+  for (auto file: files) {
+    file.name += shift;
+    all.push_back(file);
+  }
+
+  Writer out(f);
+  IndexHeader header{};
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.files = all.size();
+  out.put(&header, sizeof(header));
+
+  header.file_off = out.offset();
+  out.put(all.data(), all.size() * sizeof(IndexFile));
+
+  header.by_path_off = out.offset();
+  std::vector<uint32_t> by_path(all.size());
+  for (auto i = 0uz; i < by_path.size(); ++i) {
+    by_path[i] = i;
+  }
+  auto name = [&](uint32_t id) {
+    return std::string_view(all_names.c_str() + all[id].name);
+  };
+  std::sort(by_path.begin(), by_path.end(), [&](auto a, auto b) {
+    return name(a) < name(b);
+  });
+  out.put(by_path.data(), by_path.size() * sizeof(uint32_t));
+  out.pad();
+
+  header.names_off = out.offset();
+  out.put(all_names.data(), all_names.size());
+  out.pad();
+
+  // Merge the kept files' lists from the base with the runs, writing each
+  // trigram's list as it completes.
+  header.postings_off = out.offset();
+  std::vector<RunReader> readers;
+  for (auto run: runs) {
+    readers.emplace_back(run);
+  }
+  readers.emplace_back(postings);
+  using Head = std::pair<uint64_t, size_t>;
+  std::priority_queue<Head, std::vector<Head>, std::greater<>> heads;
+  for (auto i = 0uz; i < readers.size(); ++i) {
+    if (!readers[i].empty()) {
+      heads.emplace(readers[i].front(), i);
+    }
+  }
+  const auto old = kept ? base->trigram_table()
+                        : std::span<const IndexTrigram>();
+  auto next_old = old.begin();
+  std::vector<IndexTrigram> table;
+  std::vector<uint32_t> ids;
+  std::string buf;
+  while (!heads.empty() || next_old != old.end()) {
+    auto trigram = UINT32_MAX;
+    if (!heads.empty()) {
+      trigram = heads.top().first >> 32;
+    }
+    if (next_old != old.end()) {
+      trigram = std::min(trigram, next_old->trigram);
+    }
+    ids.clear();
+    if (next_old != old.end() && next_old->trigram == trigram) {
+      for (const auto id: base->postings(*next_old)) {
+        if (renumber[id] != UINT32_MAX) {
+          ids.push_back(renumber[id]);
+        }
+      }
+      ++next_old;
+    }
+    while (!heads.empty() && heads.top().first >> 32 == trigram) {
+      const auto [posting, i] = heads.top();
+      heads.pop();
+      ids.push_back(kept + static_cast<uint32_t>(posting));
+      readers[i].pop();
+      if (!readers[i].empty()) {
+        heads.emplace(readers[i].front(), i);
+      }
+    }
+    if (ids.empty()) {
+      continue;
+    }
+    table.push_back({trigram, static_cast<uint32_t>(ids.size()),
+                     out.offset() + buf.size() - header.postings_off});
+    uint32_t last_id = 0;
+    for (const auto id: ids) {
+      put_varint(buf, id - last_id);
+      last_id = id;
+    }
+    if (buf.size() >= 1uz << 16) {
+      out.put(buf.data(), buf.size());
+      buf.clear();
+    }
+  }
+  out.put(buf.data(), buf.size());
+  out.pad();
+
+  header.trigrams = table.size();
+  header.trigram_off = out.offset();
+  out.put(table.data(), table.size() * sizeof(IndexTrigram));
+  header.size = out.offset();
+
+  if (fseek(f, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, f) != 1
+      || fflush(f) || fsync(fileno(f))) {
+    throw_errno("write");
+  }
+}
+
+Index::Index(const char* path) {
+  const auto fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw_errno(path);
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    throw_errno(path);
+  }
+  len = st.st_size;
+  if (len < sizeof(IndexHeader)) {
+    close(fd);
+    not_an_index();
+  }
+  auto p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    throw_errno(path);
+  }
+  data = static_cast<const char*>(p);
+  header = reinterpret_cast<const IndexHeader*>(data);
+  // Every section has to be where the next one says it ends.
+  const auto& h = *header;
+  if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) || h.size != len
+      || h.file_off != sizeof(IndexHeader)
+      || h.files > UINT32_MAX
+      || h.by_path_off != h.file_off + h.files * sizeof(IndexFile)
+      || h.names_off != align8(h.by_path_off + h.files * sizeof(uint32_t))
+      || h.postings_off < h.names_off || h.trigram_off < h.postings_off
+      || h.trigram_off % 8 || h.trigrams > (1u << 24)
+      || h.trigram_off + h.trigrams * sizeof(IndexTrigram) != len
+      // So that the last name is terminated.
+      || (h.files && (h.postings_off == h.names_off
+                      || data[h.postings_off - 1]))) {
+    munmap(p, len);
+    not_an_index();
+  }
+  files = reinterpret_cast<const IndexFile*>(data + h.file_off);
+  by_path = reinterpret_cast<const uint32_t*>(data + h.by_path_off);
+  trigrams = reinterpret_cast<const IndexTrigram*>(data + h.trigram_off);
+  for (auto i = 0uz; i < h.files; ++i) {
+    if (by_path[i] >= h.files
+        || files[i].name >= h.postings_off - h.names_off) {
+      munmap(p, len);
+      not_an_index();
+    }
+  }
+}
+
+Index::~Index() {
+  munmap(const_cast<char*>(data), len);
+}
+
+std::vector<uint32_t> Index::postings(uint32_t trigram) const {
+  const auto end = trigrams + header->trigrams;
+  const auto it = std::lower_bound(trigrams, end, trigram,
+                                   [](const auto& t, auto v) {
+                                     return t.trigram < v;
+                                   });
+  if (it == end || it->trigram != trigram) {
+    return {};
+  }
+  return postings(*it);
+}
+
+std::vector<uint32_t> Index::postings(const IndexTrigram& trigram) const {
+  std::vector<uint32_t> ret;
+  const auto* p = data + header->postings_off
+      + std::min(trigram.offset, header->trigram_off - header->postings_off);
+  const auto* const limit = data + header->trigram_off;
+  uint32_t id = 0;
+  ret.reserve(std::min<size_t>(trigram.count, header->files));
+  for (auto i = 0u; i < trigram.count && p < limit; ++i) {
+    uint32_t delta = 0;
+    for (int shift = 0; p < limit && shift < 32; shift += 7) {
+      const auto b = static_cast<unsigned char>(*p++);
+      delta |= uint32_t(b & 0x7f) << shift;
+      if (!(b & 0x80)) {
+        break;
+      }
+    }
+    id += delta;
+    if (id >= header->files) {
+      break;
+    }
+    ret.push_back(id);
+  }
+  return ret;
+}
+
+std::vector<bool> Index::candidates(
+    const std::vector<std::vector<uint32_t>>& alternatives) const {
+  const auto n = header->files;
+  std::vector<bool> ret(n);
+  for (const auto& alternative: alternatives) {
+    if (alternative.empty()) {
+      for (auto i = 0uz; i < n; ++i) {
+        ret[i] = !(files[i].flags & IndexFile::BINARY);
+      }
+      return ret;
+    }
+    std::vector<std::vector<uint32_t>> lists;
+    for (const auto t: alternative) {
+      lists.push_back(postings(t));
+    }
+    // Shortest first, so that the intersection shrinks as fast as it can.
+    std::sort(lists.begin(), lists.end(), [](const auto& a, const auto& b) {
+      return a.size() < b.size();
+    });
+    auto ids = std::move(lists.front());
+    std::vector<uint32_t> both;
+    for (auto i = 1uz; i < lists.size() && ids.size(); ++i) {
+      both.clear();
+      std::set_intersection(ids.begin(), ids.end(), lists[i].begin(),
+                            lists[i].end(), std::back_inserter(both));
+      std::swap(ids, both);
+    }
+    for (const auto id: ids) {
+      ret[id] = true;
+    }
+  }
+  for (auto i = 0uz; i < n; ++i) {
+    if (files[i].flags & IndexFile::UNINDEXED) {
+      ret[i] = true;
+    }
+  }
+  return ret;
+}
+
+size_t Index::find(std::string_view path) const {
+  const auto end = by_path + header->files;
+  const auto it = std::lower_bound(by_path, end, path,
+                                   [this](auto id, auto v) {
+                                     return name(files[id]) < v;
+                                   });
+  if (it == end || name(files[*it]) != path) {
+    return npos;
+  }
+  return *it;
+}
+
+bool Index::fresh(size_t id, const struct stat& st) const {
+  return files[id].size == static_cast<uint64_t>(st.st_size)
+      && files[id].mtime == mtime_ns(st)
+      && files[id].ino == static_cast<uint64_t>(st.st_ino);
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct stat;
+
+// A trigram index of a tree, in the style of Russ Cox's codesearch: for each
+// three-byte sequence, the sorted list of files that contain it.  A search
+// for a pattern that requires a literal only needs to read the files that
+// have every trigram of the literal.  Each file's size and mtime are kept
+// too, so that files changed since the index was built can be searched
+// anyway.
+//
+// Files are keyed by the path the walk gives them, so the index only helps
+// searches run from the same directory.
+//
+// Rebuilding an index reuses what it has for files whose size, mtime and
+// inode haven't changed, so only new and changed files get read again.
+
+// The distinct trigrams of a file, as a number from the three bytes in
+// order.  Keeps its memory across clear().
+class TrigramSet {
+ public:
+  // Files with more than this many are too varied to be worth indexing, and
+  // are always searched.
+  static constexpr size_t MAX_TRIGRAMS = 30000;
+
+  void clear() noexcept;
+
+  // Adds the trigrams starting in text[0, text.size() - 2).  Returns false,
+  // and stops collecting, once there are more than MAX_TRIGRAMS.
+  bool add(std::string_view text);
+
+  const std::vector<uint32_t>& trigrams() const noexcept {
+    return found;
+  }
+
+ private:
+  std::vector<uint64_t> seen;
+  std::vector<uint32_t> found;
+};
+
+// Returns the trigrams of s, sorted and without repeats.
+std::vector<uint32_t> trigrams_of(std::string_view s);
+
+// The on-disk format, in native byte order.  Sections are 8-byte aligned.
+struct IndexHeader {
+  char magic[8];
+  uint64_t files;
+  uint64_t trigrams;
+  // IndexFile[files], then the ids of the files sorted by path, then their
+  // NUL-terminated paths.
+  uint64_t file_off;
+  uint64_t by_path_off;
+  uint64_t names_off;
+  // Each posting list is its file ids in order, as LEB128 deltas.
+  uint64_t postings_off;
+  // IndexTrigram[trigrams], sorted.
+  uint64_t trigram_off;
+  uint64_t size;
+};
+
+struct IndexFile {
+  static constexpr uint32_t BINARY = 1;
+  // Not in any posting list: search it whatever the pattern.
+  static constexpr uint32_t UNINDEXED = 2;
+
+  int64_t mtime;
+  uint64_t size;
+  uint64_t ino;
+  uint64_t name;
+  uint32_t flags;
+  uint32_t pad;
+};
+
+struct IndexTrigram {
+  uint32_t trigram;
+  uint32_t count;
+  uint64_t offset;
+};
+
+// Collects files from any number of threads and writes the index.  Postings
+// past a certain number are sorted and spilled to temporary files, so memory
+// use doesn't grow with the size of the tree.
+class Index;
+
+class IndexWriter {
+ public:
+  // Files that base has as they are can be reused rather than read.  base
+  // may be null.
+  IndexWriter(std::string path, std::unique_ptr<const Index> base);
+  ~IndexWriter();
+
+  IndexWriter(const IndexWriter&) = delete;
+  IndexWriter& operator=(const IndexWriter&) = delete;
+
+  // Adds a file that st describes, with the trigrams in set or with flags
+  // saying why it has none.  Throws std::system_error if a spill fails.
+  void add(std::string_view path, const struct stat& st, uint32_t flags,
+           const TrigramSet& set);
+
+  // If the base index has the file at path as st describes, keeps what it
+  // has for it and returns true.
+  bool reuse(std::string_view path, const struct stat& st);
+
+  // Writes the index next to its path and renames it into place.  Throws
+  // std::system_error.
+  void write();
+
+ private:
+  static constexpr size_t SPILL_POSTINGS = 16uz << 20;
+
+  void spill(std::vector<uint64_t> postings);
+  void write_to(FILE* f);
+
+  const std::string path;
+  const std::unique_ptr<const Index> base;
+  std::mutex m;
+  std::vector<IndexFile> files;
+  std::string names;
+  // A trigram in the high half and a file id in the low, in the order the
+  // files were added.
+  std::vector<uint64_t> postings;
+  // Ids in base of the files being kept.
+  std::vector<uint32_t> reused;
+
+  std::mutex spill_m;
+  std::vector<FILE*> runs;
+};
+
+// An index, mapped read-only.
+class Index {
+ public:
+  // Throws std::system_error if path can't be mapped, and std::runtime_error
+  // if it isn't an index.
+  explicit Index(const char* path);
+  ~Index();
+
+  Index(const Index&) = delete;
+  Index& operator=(const Index&) = delete;
+
+  // Returns which files may match a pattern that needs every trigram of one
+  // of the alternatives, by id.  An empty alternative needs nothing, so
+  // makes every file but binary ones a candidate.
+  std::vector<bool> candidates(
+      const std::vector<std::vector<uint32_t>>& alternatives) const;
+
+  // Returns the id of the file at path, or npos.
+  size_t find(std::string_view path) const;
+
+  // Whether the file with that id is as it was when indexed, going by st.
+  bool fresh(size_t id, const struct stat& st) const;
+
+  size_t size() const noexcept {
+    return header->files;
+  }
+
+  const IndexFile& file(size_t id) const noexcept {
+    return files[id];
+  }
+
+  std::string_view name(const IndexFile& file) const {
+    return data + header->names_off + file.name;
+  }
+
+  // The trigrams that have posting lists, in order.
+  std::span<const IndexTrigram> trigram_table() const noexcept {
+    return {trigrams, header->trigrams};
+  }
+
+  std::vector<uint32_t> postings(const IndexTrigram& trigram) const;
+
+  static constexpr size_t npos = SIZE_MAX;
+
+ private:
+  std::vector<uint32_t> postings(uint32_t trigram) const;
+
+  const char* data = nullptr;
+  size_t len = 0;
+  const IndexHeader* header = nullptr;
+  const IndexFile* files = nullptr;
+  const uint32_t* by_path = nullptr;
+  const IndexTrigram* trigrams = nullptr;
+};
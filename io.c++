@@ -1,3 +1,170 @@
 #include "io.h"
 
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+
 std::recursive_mutex io_mutex;
+
+namespace {
+
+// The length of the UTF-8 sequence at the start of s, or 0 if there isn't a
+// valid one.
+size_t utf8_length(std::string_view s) {
+  const auto c = static_cast<unsigned char>(s[0]);
+  size_t n;
+  char32_t min;
+  if (c >= 0xc2 && c < 0xe0) {
+    n = 2;
+    min = 0x80;
+  }
+  else if (c >= 0xe0 && c < 0xf0) {
+    n = 3;
+    min = 0x800;
+  }
+  else if (c >= 0xf0 && c < 0xf5) {
+    n = 4;
+    min = 0x10000;
+  }
+  else {
+    return 0;
+  }
+  if (s.size() < n) {
+    return 0;
+  }
+  char32_t cp = c & (0x7f >> n);
+  for (auto i = 1uz; i < n; ++i) {
+    const auto t = static_cast<unsigned char>(s[i]);
+    if ((t & 0xc0) != 0x80) {
+      return 0;
+    }
+    cp = cp << 6 | (t & 0x3f);
+  }
+  // Overlong, a surrogate, or past the last code point.
+  if (cp < min || (cp >= 0xd800 && cp < 0xe000) || cp > 0x10ffff) {
+    return 0;
+  }
+  return n;
+}
+
+}   // namespace
+
+void OutputBuffer::json(std::string_view s) {
+  static constexpr char HEX[] = "0123456789abcdef";
+  buf.push_back('"');
+  for (auto i = 0uz; i < s.size(); ) {
+    // Runs of plain ASCII go in as they are.
+    auto j = i;
+    for (; j < s.size(); ++j) {
+      const auto c = static_cast<unsigned char>(s[j]);
+      if (c < 0x20 || c == '"' || c == '\\' || c >= 0x80) {
+        break;
+      }
+    }
+    buf.insert(buf.end(), s.begin() + i, s.begin() + j);
+    if (j == s.size()) {
+      break;
+    }
+    const auto c = static_cast<unsigned char>(s[j]);
+    i = j + 1;
+    if (c >= 0x80) {
+      if (const auto n = utf8_length(s.substr(j))) {
+        buf.insert(buf.end(), s.begin() + j, s.begin() + j + n);
+        i = j + n;
+      }
+      else {
+        append("\\ufffd");
+      }
+      continue;
+    }
+    buf.push_back('\\');
+    switch (c) {
+      case '"': buf.push_back('"'); break;
+      case '\\': buf.push_back('\\'); break;
+      case '\b': buf.push_back('b'); break;
+      case '\f': buf.push_back('f'); break;
+      case '\n': buf.push_back('n'); break;
+      case '\r': buf.push_back('r'); break;
+      case '\t': buf.push_back('t'); break;
+      default:
+        append("u00");
+        buf.push_back(HEX[c >> 4]);
+        buf.push_back(HEX[c & 0xf]);
+    }
+  }
+  buf.push_back('"');
+}
+
+Output::Output(int fd, bool immediate): fd(fd), immediate(immediate) {
+  pending.reserve(BUFFER_SIZE);
+}
+
+Output::~Output() {
+  flush();
+}
+
+void Output::write(std::string_view block, bool separate) {
+  begin(separate);
+  append(block);
+  end();
+}
+
+void Output::begin(bool separate) {
+  m.lock();
+  if (separate && started) {
+    pending.push_back('\n');
+  }
+  started = true;
+}
+
+void Output::append(std::string_view part) {
+  if (!immediate && pending.size() + part.size() <= BUFFER_SIZE) {
+    pending.insert(pending.end(), part.begin(), part.end());
+    return;
+  }
+  write_out(std::string_view(pending.data(), pending.size()), part);
+  pending.clear();
+}
+
+void Output::end() {
+  m.unlock();
+}
+
+void Output::flush() {
+  std::lock_guard lk(m);
+  write_out(std::string_view(pending.data(), pending.size()), {});
+  pending.clear();
+}
+
+// Writes all of a and then b, in as few writev calls as it takes.
+void Output::write_out(std::string_view a, std::string_view b) {
+  iovec iov[2] = {
+    {const_cast<char*>(a.data()), a.size()},
+    {const_cast<char*>(b.data()), b.size()},
+  };
+  iovec* v = iov;
+  int n = 2;
+  while (!failed) {
+    for (; n && !v->iov_len; ++v, --n) { }
+    if (!n) {
+      return;
+    }
+    auto written = writev(fd, v, n);
+    if (written < 0) {
+      if (errno != EINTR) {
+        failed = true;
+      }
+      continue;
+    }
+    for (; written; ++v, --n) {
+      if (static_cast<size_t>(written) < v->iov_len) {
+        v->iov_base = static_cast<char*>(v->iov_base) + written;
+        v->iov_len -= written;
+        break;
+      }
+      written -= v->iov_len;
+      v->iov_len = 0;
+    }
+  }
+}
@@ -1,9 +1,14 @@
 #pragma once
 
+#include <charconv>
+#include <cstddef>
 #include <format>
 #include <iostream>
+#include <iterator>
 #include <mutex>
+#include <string_view>
 #include <utility>
+#include <vector>
 
 extern std::recursive_mutex io_mutex;
 
@@ -31,3 +36,90 @@ template <typename... Args>
 void mPrintLn(std::format_string<Args...> fmt, Args&&... args) {
   mPrintLn(std::cout, fmt, std::forward<Args>(args)...);
 }
+
+// A block of output, formatted without any lock held and then handed to
+// Output whole.  Keeps its memory across clear(), so a thread that reuses one
+// stops allocating.
+class OutputBuffer {
+ public:
+  template <typename... Args>
+  void print(std::format_string<Args...> fmt, Args&&... args) {
+    std::format_to(std::back_inserter(buf), fmt, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  void println(std::format_string<Args...> fmt, Args&&... args) {
+    print(fmt, std::forward<Args>(args)...);
+    buf.push_back('\n');
+  }
+
+  void append(std::string_view s) {
+    buf.insert(buf.end(), s.begin(), s.end());
+  }
+
+  void push_back(char c) {
+    buf.push_back(c);
+  }
+
+  // Much cheaper than print("{}", n).
+  void number(size_t n) {
+    char digits[20];
+    const auto end = std::to_chars(digits, std::end(digits), n).ptr;
+    buf.insert(buf.end(), digits, end);
+  }
+
+  // Appends s as a quoted JSON string.  Bytes that aren't UTF-8 come out as
+  // U+FFFD, since a JSON string can't hold them.
+  void json(std::string_view s);
+
+  std::string_view view() const noexcept {
+    return std::string_view(buf.data(), buf.size());
+  }
+
+  void clear() noexcept {
+    buf.clear();
+  }
+
+ private:
+  std::vector<char> buf;
+};
+
+// Writes blocks to a file descriptor in the order they come, gathering small
+// ones into big write(2)s.  The lock is only held to copy a block in, or to
+// write out a full buffer.  Anything still buffered is written by flush() or
+// the destructor.
+class Output {
+ public:
+  static constexpr size_t BUFFER_SIZE = 64uz << 10;
+
+  // If immediate is set, every block is written as soon as it comes, as a
+  // terminal wants.
+  Output(int fd, bool immediate);
+  ~Output();
+
+  Output(const Output&) = delete;
+  Output& operator=(const Output&) = delete;
+
+  // Adds a block, after a blank line if separate is set and it's not the
+  // first block.
+  void write(std::string_view block, bool separate);
+
+  // The same, for a block too big to format all at once: begin() takes the
+  // lock, and it's held through append() calls until end().
+  void begin(bool separate);
+  void append(std::string_view part);
+  void end();
+
+  void flush();
+
+ private:
+  void write_out(std::string_view a, std::string_view b);
+
+  std::mutex m;
+  const int fd;
+  const bool immediate;
+  bool started = false;
+  // Set if a write fails, after which output is dropped, as std::cout does.
+  bool failed = false;
+  std::vector<char> pending;
+};
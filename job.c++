@@ -1 +1,351 @@
 #include "job.h"
+
+#include <chrono>
+
+namespace {
+
+// Which queue and worker, if any, is running on this thread, so that push
+// knows whose deque to use.
+thread_local WorkQueue* current_queue = nullptr;
+thread_local size_t current_worker = 0;
+
+uint64_t xorshift(uint64_t& x) {
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+}   // namespace
+
+// A Chase-Lev deque, after Lê et al., "Correct and Efficient Work-Stealing for
+// Weak Memory Models" (PPoPP '13).  Only the owner pushes and pops, at the
+// bottom; anyone may steal from the top.  Arrays outgrown by push stay
+// around until the deque goes away, since a thief may still be reading one.
+class alignas(64) WorkQueue::Deque {
+ public:
+  Deque(): array(new Array(64)) {
+    retired.emplace_back(array.load(std::memory_order_relaxed));
+  }
+
+  ~Deque() {
+    for (auto i = top.load(); i < bottom.load(); ++i) {
+      delete array.load()->get(i);
+    }
+  }
+
+  void push(Job* job) {
+    const auto b = bottom.load(std::memory_order_relaxed);
+    const auto t = top.load(std::memory_order_acquire);
+    auto a = array.load(std::memory_order_relaxed);
+    if (b - t > static_cast<int64_t>(a->mask)) {
+      a = grow(a, t, b);
+    }
+    a->put(b, job);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+  }
+
+  Job* pop() {
+    const auto b = bottom.load(std::memory_order_relaxed) - 1;
+    auto a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto t = top.load(std::memory_order_relaxed);
+    Job* job = nullptr;
+    if (t <= b) {
+      job = a->get(b);
+      if (t == b) {
+        // Last one: race any thieves for it.
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+          job = nullptr;
+        }
+        bottom.store(b + 1, std::memory_order_relaxed);
+      }
+    }
+    else {
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return job;
+  }
+
+  Job* steal() {
+    while (true) {
+      auto t = top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      const auto b = bottom.load(std::memory_order_acquire);
+      if (t >= b) {
+        return nullptr;
+      }
+      auto job = array.load(std::memory_order_acquire)->get(t);
+      if (top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+        return job;
+      }
+      // Lost to the owner or another thief; there may be more.
+    }
+  }
+
+  bool empty() const noexcept {
+    return top.load(std::memory_order_relaxed)
+        >= bottom.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Array {
+    explicit Array(size_t size)
+        : mask(size - 1), slots(new std::atomic<Job*>[size]) {}
+
+    Job* get(int64_t i) const {
+      return slots[i & mask].load(std::memory_order_relaxed);
+    }
+
+    void put(int64_t i, Job* job) {
+      slots[i & mask].store(job, std::memory_order_relaxed);
+    }
+
+    const size_t mask;
+    const std::unique_ptr<std::atomic<Job*>[]> slots;
+  };
+
+  Array* grow(Array* a, int64_t t, int64_t b) {
+    auto bigger = new Array(2 * (a->mask + 1));
+    retired.emplace_back(bigger);
+    for (auto i = t; i < b; ++i) {
+      bigger->put(i, a->get(i));
+    }
+    array.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+
+  std::atomic<int64_t> top = 0;
+  alignas(64) std::atomic<int64_t> bottom = 0;
+  std::atomic<Array*> array;
+  std::vector<std::unique_ptr<Array>> retired;
+};
+
+// A worker's deques: one for jobs that expand() and one for the rest.
+struct WorkQueue::Lanes {
+  Deque jobs;
+  Deque expanding;
+  unsigned node = 0;
+  // Only the owner touches this.
+  uint64_t idle_ns = 0;
+};
+
+WorkQueue::WorkQueue(size_t workers, const std::vector<unsigned>& nodes,
+                     bool timed)
+    : backlog(BACKLOG_PER_WORKER * workers), timed(timed) {
+  for (auto i = 0uz; i < workers; ++i) {
+    auto& lane = *lanes.emplace_back(std::make_unique<Lanes>());
+    if (i < nodes.size()) {
+      lane.node = nodes[i];
+      remote_nodes |= lane.node != lanes.front()->node;
+    }
+  }
+}
+
+WorkQueue::~WorkQueue() = default;
+
+void WorkQueue::start_lazily(std::function<void(size_t)> start) {
+  this->start = std::move(start);
+  started = 1;
+}
+
+void WorkQueue::push(std::unique_ptr<Job> job) {
+  count();
+  if (current_queue == this) {
+    auto& own = *lanes[current_worker];
+    (job->expands() ? own.expanding : own.jobs).push(job.release());
+  }
+  else {
+    inject(std::move(job));
+  }
+  wake();
+}
+
+void WorkQueue::yield(std::unique_ptr<Job> job) {
+  // Workers look at the shared list after their own deques, so whatever the
+  // job pushed before yielding goes first.
+  count();
+  inject(std::move(job));
+  wake();
+}
+
+void WorkQueue::count() {
+  const auto now_pending = pending.fetch_add(1, std::memory_order_relaxed) + 1;
+  auto p = peak.load(std::memory_order_relaxed);
+  while (now_pending > p
+         && !peak.compare_exchange_weak(p, now_pending,
+                                        std::memory_order_relaxed)) {}
+}
+
+void WorkQueue::inject(std::unique_ptr<Job> job) {
+  std::lock_guard lk(m);
+  if (back) {
+    back->next = std::move(job);
+    back = back->next.get();
+  }
+  else {
+    front = std::move(job);
+    back = front.get();
+  }
+  injected.fetch_add(1, std::memory_order_relaxed);
+}
+
+void WorkQueue::wake() {
+  // Pairs with the fence in runUntilEmpty: either we see the sleeper or it
+  // sees the job.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers.load(std::memory_order_relaxed)) {
+    epoch.fetch_add(1, std::memory_order_relaxed);
+    epoch.notify_one();
+  }
+  else if (start && started.load(std::memory_order_relaxed) < lanes.size()) {
+    // Nobody is free to take the job, so start someone who will be.
+    if (const auto worker = started.fetch_add(1, std::memory_order_relaxed);
+        worker < lanes.size()) {
+      start(worker);
+    }
+  }
+}
+
+void WorkQueue::runUntilEmpty(size_t worker, Scratch& scratch) {
+  assert(worker < lanes.size());
+  current_queue = this;
+  current_worker = worker;
+  Defer d([]{ current_queue = nullptr; });
+  uint64_t rng = 0x9e3779b97f4a7c15ull * (worker + 1);
+  while (!cancelled()) {
+    if (auto job = find(worker, rng)) {
+      run(job, scratch);
+      continue;
+    }
+    sleepers.fetch_add(1, std::memory_order_relaxed);
+    // Acquire so that if the last job's bump is visible, so is pending == 0.
+    const auto e = epoch.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto job = find(worker, rng);
+    if (!job) {
+      if (!pending.load(std::memory_order_acquire) || cancelled()) {
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+        return;
+      }
+      if (!timed) {
+        epoch.wait(e, std::memory_order_relaxed);
+      }
+      else {
+        const auto start = std::chrono::steady_clock::now();
+        epoch.wait(e, std::memory_order_relaxed);
+        lanes[worker]->idle_ns += std::chrono::duration_cast<
+            std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+                                      - start).count();
+      }
+    }
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+    if (job) {
+      run(job, scratch);
+    }
+  }
+}
+
+void WorkQueue::cancel() {
+  stopped.store(true, std::memory_order_relaxed);
+  // Released by the bump, for sleepers that see it.
+  epoch.fetch_add(1, std::memory_order_release);
+  epoch.notify_all();
+}
+
+uint64_t WorkQueue::idle_ns(size_t worker) const noexcept {
+  return lanes[worker]->idle_ns;
+}
+
+Job* WorkQueue::find(size_t worker, uint64_t& rng) {
+  auto& own = *lanes[worker];
+  if (auto job = own.jobs.pop()) {
+    return job;
+  }
+  // Backlogged, the others' jobs come before expanding any more.  Otherwise
+  // thieves go for the expanding jobs, which spread the walk out.
+  const bool drain = backlogged();
+  if (drain) {
+    if (auto job = steal(worker, rng, false, false)) {
+      return job;
+    }
+  }
+  if (auto job = own.expanding.pop()) {
+    return job;
+  }
+  if (auto job = take_injected()) {
+    return job;
+  }
+  for (const bool remote: {false, true}) {
+    if (remote && !remote_nodes) {
+      break;
+    }
+    if (remote && drain) {
+      if (auto job = steal(worker, rng, false, true)) {
+        return job;
+      }
+    }
+    if (auto job = steal(worker, rng, true, remote)) {
+      return job;
+    }
+    if (!drain) {
+      if (auto job = steal(worker, rng, false, remote)) {
+        return job;
+      }
+    }
+  }
+  return nullptr;
+}
+
+Job* WorkQueue::steal(size_t worker, uint64_t& rng, bool expanding,
+                      bool remote) {
+  const auto n = lanes.size();
+  const auto start = xorshift(rng) % n;
+  const auto node = lanes[worker]->node;
+  for (auto i = 0uz; i < n; ++i) {
+    const auto victim = (start + i) % n;
+    if (victim == worker || (lanes[victim]->node != node) != remote) {
+      continue;
+    }
+    auto& deque = expanding ? lanes[victim]->expanding : lanes[victim]->jobs;
+    if (deque.empty()) {
+      continue;
+    }
+    if (auto job = deque.steal()) {
+      return job;
+    }
+  }
+  return nullptr;
+}
+
+Job* WorkQueue::take_injected() {
+  if (!injected.load(std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  std::lock_guard lk(m);
+  if (!front) {
+    return nullptr;
+  }
+  auto job = std::move(front);
+  front = std::move(job->next);
+  if (!front) {
+    back = nullptr;
+  }
+  injected.fetch_sub(1, std::memory_order_relaxed);
+  return job.release();
+}
+
+void WorkQueue::run(Job* job, Scratch& scratch) {
+  Defer d([this]{
+    if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      // That was the last one; let the sleepers see that and leave.
+      epoch.fetch_add(1, std::memory_order_release);
+      epoch.notify_all();
+    }
+  });
+  (*std::unique_ptr<Job>(job))(scratch);
+}
@@ -2,17 +2,31 @@
 
 #include <atomic>
 #include <cassert>
-#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <utility>
+#include <vector>
 
 class WorkQueue;
 
+// Per-worker state that jobs may reuse from one run to the next.  Defined by
+// the program; each thread running jobs owns one.
+struct Scratch;
+
 class Job {
  public:
   virtual ~Job() = default;
-  virtual void operator()() = 0;
+  virtual void operator()(Scratch& scratch) = 0;
+
+  // Whether the job is mostly there to push others, like walking a
+  // directory.  Workers put those off while the queue is backlogged.
+  virtual bool expands() const noexcept {
+    return false;
+  }
+
  private:
   std::unique_ptr<Job> next;
   friend class WorkQueue;
@@ -26,65 +40,113 @@ struct Defer {
   }
 };
 
+// A work-stealing executor.  Each worker has its own deque: jobs pushed from
+// a worker go on the bottom of its deque, and it takes from the bottom too, so
+// a directory's entries get searched before the rest of the tree is expanded.
+// Idle workers steal from the top of a random other worker's deque.  Jobs
+// pushed from outside the workers go on a shared list, which only needs its
+// lock while it's nonempty.
+//
+// There's no global lock: termination is detected by counting jobs that are
+// pushed but not yet finished, and idle workers sleep on an epoch counter that
+// pushes bump when someone is asleep.
+//
+// Jobs that expand() go on a second deque of their own, so workers can run
+// the rest first.  Each worker does that with its own jobs anyway; once the
+// queue is backlogged it steals the rest before expanding anything, and
+// expanding jobs are expected to yield() until it drains, so that the queue
+// stays about the same size however big the tree.  Pushes never block, since
+// a worker that waited for room could be waiting on itself.
+//
+// Workers pinned to CPUs on several NUMA nodes steal from the others on
+// their own node first, and only go to another node once there's nothing
+// left on theirs: a job stolen from there has its memory there, and leaves
+// the caches that were warm for it behind.
 class WorkQueue {
  public:
-  void push(std::unique_ptr<Job> job) {
-    std::unique_lock lk(m);
-    (void)++pending;
-    if (back) {
-      back->next = std::move(job);
-      back = back->next.get();
-    }
-    else {
-      front = std::move(job);
-      back = front.get();
-      lk.unlock();
-      cv.notify_one();
-    }
+  // Jobs pending per worker past which the queue is backlogged.
+  static constexpr size_t BACKLOG_PER_WORKER = 256;
+
+  // nodes has each worker's NUMA node, if they're pinned to any.  With
+  // timed, workers time their sleeps for idle_ns().
+  explicit WorkQueue(size_t workers, const std::vector<unsigned>& nodes = {},
+                     bool timed = false);
+  ~WorkQueue();
+
+  WorkQueue(const WorkQueue&) = delete;
+  WorkQueue& operator=(const WorkQueue&) = delete;
+
+  // Has pushes call start(i) to get a thread running worker i, for each i
+  // from 1 on, whenever they find the workers started so far all busy.
+  // Starting worker 0 is up to the caller.  Call before anything is pushed.
+  void start_lazily(std::function<void(size_t)> start);
+
+  void push(std::unique_ptr<Job> job);
+
+  // Pushes a job that's making way for the backlog, to be run after the
+  // pushing worker's other jobs.
+  void yield(std::unique_ptr<Job> job);
+
+  // Or would be, with `more` jobs still to be pushed.
+  bool backlogged(size_t more = 0) const noexcept {
+    return pending.load(std::memory_order_relaxed) + more > backlog;
   }
 
-  bool runOne() {
-    auto job = take();
-    if (job) {
-      Defer d([this]{
-        std::unique_lock lk(m);
-        assert(pending > 0);
-        if (--pending == 0) {
-          assert(!front);
-          lk.unlock();
-          cv.notify_all();
-        }
-      });
-      (*std::move(job))();
-      return true;
-    }
-    return false;
+  size_t workers() const noexcept {
+    return lanes.size();
   }
 
-  void runUntilEmpty() {
-    while (runOne()) { }
+  // Makes each worker return from runUntilEmpty once it's done with the job
+  // it's on, dropping the rest.  Long jobs may check cancelled() to stop
+  // sooner.
+  void cancel();
+
+  bool cancelled() const noexcept {
+    return stopped.load(std::memory_order_relaxed);
   }
 
- private:
-  std::unique_ptr<Job> take() {
-    std::unique_lock lk(m);
-    cv.wait(lk, [this]{ return front || !pending; });
-    auto ret = std::move(front);
-    if (ret) {
-      front = std::move(ret->next);
-      if (front) {
-        lk.unlock();
-        cv.notify_one();
-      } else {
-        back = nullptr;
-      }
-    }
-    return ret;
+  // Runs jobs as worker number `worker` until every pushed job has finished.
+  void runUntilEmpty(size_t worker, Scratch& scratch);
+
+  // How long the worker has spent asleep waiting for jobs, in nanoseconds,
+  // if the queue is timed.  Only meaningful once it has returned from
+  // runUntilEmpty.
+  uint64_t idle_ns(size_t worker) const noexcept;
+
+  // The most jobs that were ever pushed but not yet finished at once.
+  size_t peak_pending() const noexcept {
+    return peak.load(std::memory_order_relaxed);
   }
 
+ private:
+  class Deque;
+  struct Lanes;
+
+  void count();
+  void inject(std::unique_ptr<Job> job);
+  void wake();
+  Job* find(size_t worker, uint64_t& rng);
+  // From the workers on worker's node, or if remote is set, the others.
+  Job* steal(size_t worker, uint64_t& rng, bool expanding, bool remote);
+  Job* take_injected();
+  void run(Job* job, Scratch& scratch);
+
+  std::vector<std::unique_ptr<Lanes>> lanes;
+  const size_t backlog;
+  const bool timed;
+  // Whether the workers are on more than one node.
+  bool remote_nodes = false;
+
+  std::atomic<size_t> pending = 0;
+  std::atomic<size_t> peak = 0;
+  std::atomic<uint32_t> epoch = 0;
+  std::atomic<size_t> sleepers = 0;
+  std::atomic<bool> stopped = false;
+  std::function<void(size_t)> start;
+  std::atomic<size_t> started = 0;
+
+  std::atomic<size_t> injected = 0;
   std::mutex m;
-  std::condition_variable cv;
-  int pending = 0;
   std::unique_ptr<Job> front;
   Job* back = nullptr;
 };
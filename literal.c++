@@ -0,0 +1,308 @@
+#include "literal.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+constexpr auto npos = std::string_view::npos;
+
+// GCC and clang lower operations on this to SSE2 on x86 and NEON on ARM;
+// with wider blocks, targets without AVX2 get much worse code.
+typedef uint8_t block __attribute__((vector_size(16)));
+
+constexpr bool is_alnum(char c) {
+  return ('0' <= c && c <= '9') || ('a' <= c && c <= 'z')
+      || ('A' <= c && c <= 'Z');
+}
+
+// Returns the index just past the character class starting at pattern[i], or
+// npos if it's unterminated.
+size_t skip_class(std::string_view pattern, size_t i) {
+  ++i;
+  if (i < pattern.size() && pattern[i] == '^') {
+    ++i;
+  }
+  if (i < pattern.size() && pattern[i] == ']') {
+    ++i;
+  }
+  while (i < pattern.size()) {
+    if (pattern[i] == '\\') {
+      i += 2;
+    }
+    else if (pattern.substr(i).starts_with("[:")) {
+      auto end = pattern.find(":]", i + 2);
+      if (end == npos) {
+        return npos;
+      }
+      i = end + 2;
+    }
+    else if (pattern[i] == ']') {
+      return i + 1;
+    }
+    else {
+      ++i;
+    }
+  }
+  return npos;
+}
+
+// Returns the index just past the group starting at pattern[i], or npos if
+// it's unterminated.
+size_t skip_group(std::string_view pattern, size_t i) {
+  int depth = 0;
+  while (i < pattern.size()) {
+    switch (pattern[i]) {
+    case '\\':
+      i += 2;
+      continue;
+    case '[':
+      i = skip_class(pattern, i);
+      continue;
+    case '(':
+      ++depth;
+      break;
+    case ')':
+      if (--depth == 0) {
+        return i + 1;
+      }
+      break;
+    }
+    ++i;
+  }
+  return npos;
+}
+
+// Parses a repetition like {2}, {2,} or {2,5} at the start of s, setting min
+// and returning its length, or returns 0 if s doesn't start with one (in
+// which case RE2 takes the brace literally).
+size_t parse_repeat(std::string_view s, int& min) {
+  size_t i = 1;
+  auto digits = [&] {
+    const auto start = i;
+    int n = 0;
+    for (; i < s.size() && '0' <= s[i] && s[i] <= '9'; ++i) {
+      n = std::min(n * 10 + (s[i] - '0'), 1000000);
+    }
+    return i == start ? -1 : n;
+  };
+  min = digits();
+  if (min < 0) {
+    return 0;
+  }
+  if (i < s.size() && s[i] == ',') {
+    ++i;
+    (void)digits();
+  }
+  if (i < s.size() && s[i] == '}') {
+    return i + 1;
+  }
+  return 0;
+}
+
+}   // namespace
+
+std::string required_literal(std::string_view pattern) {
+  std::string best, cur;
+  // Where the last atom starts in cur, if it was a literal.
+  size_t last = npos;
+  auto end_run = [&] {
+    if (cur.size() > best.size()) {
+      best = cur;
+    }
+    cur.clear();
+    last = npos;
+  };
+  // The last atom may repeat any number of times, including none.
+  auto star = [&] {
+    if (last != npos) {
+      cur.resize(last);
+    }
+    end_run();
+  };
+  // The last atom occurs at least once: the run so far is required, and so
+  // is a run that starts with the atom's final repetition.
+  auto plus = [&] {
+    if (last == npos) {
+      end_run();
+      return;
+    }
+    auto atom = cur.substr(last);
+    end_run();
+    cur = std::move(atom);
+  };
+  for (size_t i = 0; i < pattern.size(); ) {
+    const char c = pattern[i];
+    switch (c) {
+    case '|':
+      return {};
+    case '(': {
+      if (pattern.substr(i).starts_with("(?")) {
+        auto flags = pattern.substr(i + 2);
+        flags = flags.substr(0, flags.find_first_of(":)"));
+        if (flags.substr(0, flags.find('-')).find('i') != npos) {
+          return {};
+        }
+      }
+      i = skip_group(pattern, i);
+      if (i == npos) {
+        return {};
+      }
+      end_run();
+      continue;
+    }
+    case '[':
+      i = skip_class(pattern, i);
+      if (i == npos) {
+        return {};
+      }
+      end_run();
+      continue;
+    case '.':
+    case '^':
+    case '$':
+      end_run();
+      ++i;
+      continue;
+    case '*':
+    case '?':
+      star();
+      ++i;
+      continue;
+    case '+':
+      plus();
+      ++i;
+      continue;
+    case '{': {
+      int min;
+      if (auto n = parse_repeat(pattern.substr(i), min)) {
+        min ? plus() : star();
+        i += n;
+        continue;
+      }
+      break;
+    }
+    case '\\': {
+      if (i + 1 == pattern.size()) {
+        return {};
+      }
+      const char e = pattern[i + 1];
+      if (!is_alnum(e)) {
+        last = cur.size();
+        cur += e;
+        i += 2;
+        continue;
+      }
+      // Classes, assertions and escapes like \x41 and \Q...\E.  Treating them
+      // as unknown only ever makes the result shorter.
+      end_run();
+      i += 2;
+      if (e == 'Q') {
+        auto q = pattern.find("\\E", i);
+        i = q == npos ? pattern.size() : q + 2;
+      }
+      else if ((e == 'p' || e == 'P' || e == 'x')
+               && i < pattern.size() && pattern[i] == '{') {
+        auto q = pattern.find('}', i);
+        i = q == npos ? pattern.size() : q + 1;
+      }
+      else if (e == 'x') {
+        i += 2;
+      }
+      else if (e == 'p' || e == 'P') {
+        i += 1;
+      }
+      else if ('0' <= e && e <= '7') {
+        // An octal escape takes up to three digits: \101 is A.
+        const auto end = std::min(i + 2, pattern.size());
+        while (i < end && '0' <= pattern[i] && pattern[i] <= '7') {
+          ++i;
+        }
+      }
+      continue;
+    }
+    }
+    // A literal character, along with any UTF-8 continuation bytes so that a
+    // following repetition applies to the whole code point.
+    last = cur.size();
+    cur += c;
+    for (++i; i < pattern.size() && (pattern[i] & 0xc0) == 0x80; ++i) {
+      cur += pattern[i];
+    }
+  }
+  end_run();
+  return best;
+}
+
+size_t find_literal(std::string_view hay, std::string_view needle,
+                    size_t pos) {
+  if (pos > hay.size() || needle.size() > hay.size() - pos) {
+    return npos;
+  }
+  if (needle.empty()) {
+    return pos;
+  }
+  const char* const base = hay.data();
+  const char* p = base + pos;
+  // One past the last place the needle could start.
+  const char* const end = base + hay.size() - needle.size() + 1;
+  if (needle.size() == 1) {
+    p = static_cast<const char*>(std::memchr(p, needle[0], end - p));
+    return p ? p - base : npos;
+  }
+
+  // Compare the needle's first and last bytes against a block of positions
+  // at once, and only memcmp where both agree.
+  const size_t last = needle.size() - 1;
+  const block first_byte = block{} + static_cast<uint8_t>(needle.front());
+  const block last_byte = block{} + static_cast<uint8_t>(needle.back());
+  for (; static_cast<size_t>(end - p) >= sizeof(block);
+       p += sizeof(block)) {
+    block a, b;
+    std::memcpy(&a, p, sizeof(block));
+    std::memcpy(&b, p + last, sizeof(block));
+    const block eq = (block)((a == first_byte) & (b == last_byte));
+    uint64_t any[sizeof(block) / sizeof(uint64_t)];
+    std::memcpy(any, &eq, sizeof(block));
+    if (!(any[0] | any[1])) {
+      continue;
+    }
+    for (auto i = 0uz; i < sizeof(block); ++i) {
+      if (eq[i] && !std::memcmp(p + i + 1, needle.data() + 1, last - 1)) {
+        return p + i - base;
+      }
+    }
+  }
+  for (; p < end; ++p) {
+    p = static_cast<const char*>(std::memchr(p, needle[0], end - p));
+    if (!p) {
+      break;
+    }
+    if (!std::memcmp(p + 1, needle.data() + 1, last)) {
+      return p - base;
+    }
+  }
+  return npos;
+}
+
+size_t count_lines(std::string_view buf) {
+  const char* p = buf.data();
+  const char* const end = p + buf.size();
+  const block nl = block{} + static_cast<uint8_t>('\n');
+  size_t n = 0;
+  while (static_cast<size_t>(end - p) >= sizeof(block)) {
+    // Per-lane counts, flushed before they can overflow.
+    block counts{};
+    for (int i = 0; i < 255 && static_cast<size_t>(end - p) >= sizeof(block);
+         ++i, p += sizeof(block)) {
+      block a;
+      std::memcpy(&a, p, sizeof(block));
+      counts -= (block)(a == nl);
+    }
+    for (auto i = 0uz; i < sizeof(block); ++i) {
+      n += counts[i];
+    }
+  }
+  return n + std::count(p, end, '\n');
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Returns a string that occurs in every match of the RE2 pattern, or empty if
+// no such string can be found.  Only considers the top level of the pattern,
+// so e.g. `foo(bar)?baz` gives "foo" and anything with a top-level `|` or a
+// case-insensitive flag gives nothing.
+std::string required_literal(std::string_view pattern);
+
+// Returns the offset of the first occurrence of needle in hay at or after
+// pos, or npos.
+size_t find_literal(std::string_view hay, std::string_view needle,
+                    size_t pos = 0);
+
+// Returns the number of newlines in buf.
+size_t count_lines(std::string_view buf);
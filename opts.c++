@@ -3,8 +3,11 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 
+#include "filter.h"
 #include "io.h"
 
 static_assert(
@@ -22,23 +25,76 @@ static_assert(
         }), "missing short_opts func");
 
 [[noreturn]] void usage(std::string_view argv0) {
-  mPrintLn(std::cerr, "usage: {} [options] <pattern> [path ...]", argv0);
+  mPrintLn(std::cerr, "usage: {} [options] <pattern> [path ...]\n"
+           "       {} [options] -e <pattern> ... [path ...]\n"
+           "       {} --index [--index-file <file>] [path ...]",
+           argv0, argv0, argv0);
   mPrintLn(
       std::cerr,
 
-      "\nRecursively search for pattern in path.\n"
+      "\nRecursively search for pattern in path.  A path of - means standard\n"
+      "input, which is what gets searched without any path if it's a pipe.\n"
       "Uses the re2 regular expression library.\n\n"
 
       "Options:\n"
       "  -A --after-context <num> Show num lines of context after each match\n"
       "  -B --before-context <num>\n"
       "                           Show num lines of context before each match\n"
+      "     --binary-sniff <num>  Only look for binary data in the first num\n"
+      "                           bytes of each file; 0 searches any file\n"
+      "                           as text (default looks at all of it)\n"
+      "     --cache               Keep what each file held, in\n"
+      "                           $XDG_CACHE_HOME/gr, and skip reading files\n"
+      "                           that haven't changed where that'll do\n"
       "  -C --context <num>       Show num lines before and after each match\n"
       "  -c --count               Show count of matches only\n"
+      "  -e --regexp <pattern>    Search for pattern; may be repeated\n"
+      "  -f --file <file>         Search for each line of file as a pattern\n"
+      "  -g --glob <glob>         Only search files matching glob, as in a\n"
+      "                           .gitignore; may be repeated, and with a\n"
+      "                           leading ! skips what matches instead\n"
+      "  -i --ignore-case         Match without regard to case\n"
+      "     --index               Index path for later searches instead of\n"
+      "                           searching it\n"
+      "     --index-file <file>   Where the index is (default .gr-index);\n"
+      "                           searches use it if it's there\n"
+      "     --json                Print a JSON object per line: path, line,\n"
+      "                           offset, text and each match's [start, end)\n"
       "  -l --files-with-matches  Only print filenames that contain matches\n"
       "                           (don't print the matching lines)\n"
       "     --long-lines          Print long lines (default truncates to ~2k)\n"
+      "  -m --max-count <num>     Stop searching a file after num matching\n"
+      "                           lines\n"
+      "     --max-filesize <num>  Skip files bigger than num bytes, or with\n"
+      "                           K, M or G, KiB, MiB or GiB\n"
+      "     --no-ignore           Search files that .gitignore or .ignore\n"
+      "                           files say to skip\n"
+      "     --no-index            Search every file even if there's an index\n"
+      "     --no-io-uring         Open and read files one by one, not in\n"
+      "                           batches through io_uring\n"
+      "  -0 --null                End the paths -l and -c print with NUL\n"
+      "     --pin-threads         Keep each thread on a CPU of its own,\n"
+      "                           spread over the NUMA nodes, taking work\n"
+      "                           from its own node first\n"
       "  -Q --literal             Match pattern as literal, not regexp\n"
+      "  -q --quiet               Print nothing; exit 0 at the first match\n"
+      "     --regex-mem <MiB>     Memory each compiled regexp may use\n"
+      "                           (default 8, more for many patterns)\n"
+      "  -z --search-zip          Search what gzip, xz and zstd files hold,\n"
+      "                           decompressing them as they're read\n"
+      "     --show-pattern        Print which patterns each line matches,\n"
+      "                           numbered from 1\n"
+      "  -S --smart-case          Ignore case unless the pattern has\n"
+      "                           uppercase letters\n"
+      "     --sort <by>           Print files in order of path (path), or as\n"
+      "                           they're searched (none, the default)\n"
+      "     --stats               Print counts and timings to stderr\n"
+      "     --stats-json          Print --stats as a JSON object\n"
+      "  -j --threads <num>       Search with num threads (default one per\n"
+      "                           CPU)\n"
+      "  -t --type <type>         Only search files of type, going by their\n"
+      "                           names; may be repeated\n"
+      "     --type-list           Print the types -t knows and exit\n"
       "  -h --help                Print this usage message and exit.\n"
       "     --version             Print the program version.");
   exit(2);
@@ -55,7 +111,8 @@ lookup_long_opt(std::string_view opt) {
       });
   if (it != std::end(ArgParser::long_opts)
       && std::get<0>(*it).starts_with(opt)) {
-    if (it + 1 != std::end(ArgParser::long_opts)
+    // Or --file would be ambiguous with --files-with-matches.
+    if (std::get<0>(*it) != opt && it + 1 != std::end(ArgParser::long_opts)
         && std::get<0>(*(it + 1)).starts_with(opt)) {
       throw ArgumentError{"ambiguous option --{}", opt};
     }
@@ -88,6 +145,48 @@ void swap_portions(char const* argv[], int* first_nonopt, int* last_nonopt,
 
 }   // namespace
 
+void ArgParser::do_file(Opts& o, std::string_view arg) {
+  std::ifstream file;
+  if (arg != "-") {
+    file.open(std::string(arg));
+    if (!file) {
+      throw ArgumentError{"{}: {}", arg, std::strerror(errno)};
+    }
+  }
+  std::istream& in = arg == "-" ? std::cin : file;
+  o.patterns_from_stdin |= arg == "-";
+  for (std::string line; std::getline(in, line); ) {
+    o.patterns.push_back(std::move(line));
+  }
+  if (in.bad()) {
+    throw ArgumentError{"{}: read error", arg};
+  }
+  o.have_patterns = true;
+}
+
+void ArgParser::do_max_filesize(Opts& o, std::string_view arg) {
+  auto shift = 0;
+  if (arg.size()) {
+    switch (arg.back()) {
+      case 'K': case 'k': shift = 10; break;
+      case 'M': case 'm': shift = 20; break;
+      case 'G': case 'g': shift = 30; break;
+    }
+  }
+  read_int(o.max_filesize, arg.substr(0, arg.size() - !!shift));
+  if (o.max_filesize > SIZE_MAX >> shift) {
+    throw ArgumentError{"invalid size: '{}'", arg};
+  }
+  o.max_filesize <<= shift;
+}
+
+void ArgParser::do_type(Opts& o, std::string_view arg) {
+  if (!find_file_type(arg)) {
+    throw ArgumentError{"unknown type '{}'; --type-list lists them", arg};
+  }
+  o.types.push_back(arg);
+}
+
 void ArgParser::parse_args(const int argc, char const* argv[], Opts& opts) {
   opts.argv0 = *argv;
   opts.stdout_is_tty = isatty(fileno(stdout));
@@ -102,7 +201,9 @@ void ArgParser::parse_args(const int argc, char const* argv[], Opts& opts) {
       first_nonopt = optind;
     }
     std::string_view opt;
-    while (optind < argc && !(opt = argv[optind]).starts_with('-')) {
+    // A lone "-" is stdin, not an option.
+    while (optind < argc
+           && (!(opt = argv[optind]).starts_with('-') || opt == "-")) {
       ++optind;
     }
     last_nonopt = optind;
@@ -199,18 +300,20 @@ void ArgParser::parse_args(const int argc, char const* argv[], Opts& opts) {
       }
     }
   }
-  if (opts.hflag || opts.version) {
+  if (opts.hflag || opts.version || opts.type_list) {
     return;
   }
-  if (optind == argc) {
-    throw ArgumentError{"missing pattern"};
+  if (!opts.have_patterns && !opts.index) {
+    if (optind == argc) {
+      throw ArgumentError{"missing pattern"};
+    }
+    opts.patterns.emplace_back(argv[optind++]);
   }
-  opts.pattern = argv[optind++];
   if (optind < argc) {
     opts.paths = std::vector<std::string_view>(argv + optind, argv + argc);
   }
 
-  if (opts.count || opts.lflag) {
+  if (opts.count || opts.lflag || opts.quiet) {
     opts.before_context = opts.after_context = 0;
   }
 }
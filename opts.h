@@ -2,6 +2,7 @@
 
 #include <array>
 #include <charconv>
+#include <cstddef>
 #include <cstdint>
 #include <format>
 #include <string>
@@ -20,17 +21,59 @@ struct ArgumentError: std::runtime_error {
 
 struct Opts {
   std::string_view argv0;
-  std::string_view pattern;
+  // In the order given, by -e and -f or else as the first argument.
+  std::vector<std::string> patterns;
+  bool have_patterns = false;
+  // Whether -f read them from standard input.
+  bool patterns_from_stdin = false;
   std::vector<std::string_view> paths;
   bool stdout_is_tty = false;
   uint16_t before_context = 0;
   uint16_t after_context = 0;
+  // How far into each file to look for binary data.
+  size_t binary_sniff = SIZE_MAX;
+  // Remember what files held, and skip those that haven't changed.
+  bool cache = false;
   bool count = false;
+  // For -g, with ! for those that leave files out.
+  std::vector<std::string_view> globs;
   bool hflag = false;
+  bool ignore_case = false;
+  bool index = false;
+  std::string_view index_file = ".gr-index";
+  // Batch opens and reads through io_uring, where the kernel has it.
+  bool io_uring = true;
+  // One JSON object per line printed, in place of the text.
+  bool json = false;
   bool lflag = false;
   bool llflag = false;
+  size_t max_count = SIZE_MAX;
+  // Skip files bigger than this.
+  size_t max_filesize = SIZE_MAX;
   bool multiline = false;
+  bool no_ignore = false;
+  bool no_index = false;
+  // End paths printed by -l or -c with NUL.
+  bool null = false;
+  // Keep each worker on a CPU, spread over the NUMA nodes.
+  bool pin_threads = false;
   bool qflag = false;
+  bool quiet = false;
+  // In MiB for each compiled regexp; 0 leaves it to main.
+  size_t regex_mem = 0;
+  // Search what gzip, xz and zstd files hold.
+  bool search_zip = false;
+  bool show_pattern = false;
+  bool smart_case = false;
+  // Print files in the order of the walk, with entries sorted by name.
+  bool sort = false;
+  bool stats = false;
+  bool stats_json = false;
+  // How many workers; 0 leaves it to the number of CPUs.
+  size_t threads = 0;
+  // For -t, known to find_file_type().
+  std::vector<std::string_view> types;
+  bool type_list = false;
   bool version = false;
 
   Opts() = default;
@@ -54,40 +97,146 @@ struct ArgParser {
   static constexpr arg_func do_bflag = [](Opts& o, std::string_view arg) {
     read_int(o.before_context, arg);
   };
+  static constexpr arg_func do_binary_sniff = [](Opts& o,
+                                                std::string_view arg) {
+    read_int(o.binary_sniff, arg);
+  };
+  static constexpr opt_func do_cache = [](Opts& o) { o.cache = true; };
   static constexpr arg_func do_cflag = [](Opts& o, std::string_view arg) {
     read_int(o.after_context, arg);
     o.before_context = o.after_context;
   };
   static constexpr opt_func do_count = [](Opts& o) { o.count = true; };
+  static constexpr arg_func do_regexp = [](Opts& o, std::string_view arg) {
+    o.patterns.emplace_back(arg);
+    o.have_patterns = true;
+  };
+  // Reads one pattern per line from a file, or stdin for -.  Throws
+  // ArgumentError.
+  static void do_file(Opts& o, std::string_view arg);
+  static constexpr arg_func do_glob = [](Opts& o, std::string_view arg) {
+    o.globs.push_back(arg);
+  };
   static constexpr opt_func do_hflag = [](Opts& o) { o.hflag = true; };
+  static constexpr opt_func do_ignore_case = [](Opts& o) {
+    o.ignore_case = true;
+  };
+  static constexpr opt_func do_index = [](Opts& o) { o.index = true; };
+  static constexpr arg_func do_index_file = [](Opts& o, std::string_view arg) {
+    o.index_file = arg;
+  };
+  static constexpr opt_func do_json = [](Opts& o) { o.json = true; };
   static constexpr opt_func do_lflag = [](Opts& o) { o.lflag = true; };
   static constexpr opt_func do_llflag = [](Opts& o) { o.llflag = true; };
+  static constexpr arg_func do_max_count = [](Opts& o, std::string_view arg) {
+    read_int(o.max_count, arg);
+  };
+  // Takes a K, M or G suffix.  Throws ArgumentError.
+  static void do_max_filesize(Opts& o, std::string_view arg);
+  static constexpr opt_func do_null = [](Opts& o) { o.null = true; };
+  static constexpr opt_func do_pin_threads = [](Opts& o) {
+    o.pin_threads = true;
+  };
   static constexpr opt_func do_qflag = [](Opts& o) { o.qflag = true; };
+  static constexpr opt_func do_quiet = [](Opts& o) { o.quiet = true; };
   static constexpr opt_func do_multiline = [](Opts& o) { o.multiline = true; };
+  static constexpr opt_func do_no_ignore = [](Opts& o) { o.no_ignore = true; };
+  static constexpr opt_func do_no_index = [](Opts& o) { o.no_index = true; };
+  static constexpr opt_func do_no_io_uring = [](Opts& o) {
+    o.io_uring = false;
+  };
+  static constexpr arg_func do_regex_mem = [](Opts& o, std::string_view arg) {
+    read_int(o.regex_mem, arg);
+  };
+  static constexpr opt_func do_search_zip = [](Opts& o) {
+    o.search_zip = true;
+  };
+  static constexpr opt_func do_show_pattern = [](Opts& o) {
+    o.show_pattern = true;
+  };
+  static constexpr opt_func do_smart_case = [](Opts& o) {
+    o.smart_case = true;
+  };
+  static constexpr arg_func do_sort = [](Opts& o, std::string_view arg) {
+    if (arg != "path" && arg != "none") {
+      throw ArgumentError{"invalid sort: '{}'", arg};
+    }
+    o.sort = arg == "path";
+  };
+  static constexpr opt_func do_stats = [](Opts& o) { o.stats = true; };
+  static constexpr opt_func do_stats_json = [](Opts& o) {
+    o.stats = o.stats_json = true;
+  };
+  static constexpr arg_func do_threads = [](Opts& o, std::string_view arg) {
+    read_int(o.threads, arg);
+  };
+  // Throws ArgumentError for a type find_file_type() doesn't know.
+  static void do_type(Opts& o, std::string_view arg);
+  static constexpr opt_func do_type_list = [](Opts& o) {
+    o.type_list = true;
+  };
   static constexpr opt_func do_version = [](Opts& o) { o.version = true; };
 
   static constexpr std::array long_opts {
     std::pair {"after-context"sv, func(do_aflag)},
     std::pair {"before-context"sv, func(do_bflag)},
+    std::pair {"binary-sniff"sv, func(do_binary_sniff)},
+    std::pair {"cache"sv, func(do_cache)},
     std::pair {"context"sv, func(do_cflag)},
     std::pair {"count"sv, func(do_count)},
+    std::pair {"file"sv, func(do_file)},
     std::pair {"files-with-matches"sv, func(do_lflag)},
+    std::pair {"glob"sv, func(do_glob)},
     std::pair {"help"sv, func(do_hflag)},
+    std::pair {"ignore-case"sv, func(do_ignore_case)},
+    std::pair {"index"sv, func(do_index)},
+    std::pair {"index-file"sv, func(do_index_file)},
+    std::pair {"json"sv, func(do_json)},
     std::pair {"literal"sv, func(do_qflag)},
     std::pair {"long-lines"sv, func(do_llflag)},
+    std::pair {"max-count"sv, func(do_max_count)},
+    std::pair {"max-filesize"sv, func(do_max_filesize)},
     std::pair {"multiline"sv, func(do_multiline)},
+    std::pair {"no-ignore"sv, func(do_no_ignore)},
+    std::pair {"no-index"sv, func(do_no_index)},
+    std::pair {"no-io-uring"sv, func(do_no_io_uring)},
+    std::pair {"null"sv, func(do_null)},
+    std::pair {"pin-threads"sv, func(do_pin_threads)},
+    std::pair {"quiet"sv, func(do_quiet)},
+    std::pair {"regex-mem"sv, func(do_regex_mem)},
+    std::pair {"regexp"sv, func(do_regexp)},
+    std::pair {"search-zip"sv, func(do_search_zip)},
+    std::pair {"show-pattern"sv, func(do_show_pattern)},
+    std::pair {"smart-case"sv, func(do_smart_case)},
+    std::pair {"sort"sv, func(do_sort)},
+    std::pair {"stats"sv, func(do_stats)},
+    std::pair {"stats-json"sv, func(do_stats_json)},
+    std::pair {"threads"sv, func(do_threads)},
+    std::pair {"type"sv, func(do_type)},
+    std::pair {"type-list"sv, func(do_type_list)},
     std::pair {"version"sv, func(do_version)},
   };
 
-  static constexpr auto short_opt_chars { "ABCQchl"sv };
+  static constexpr auto short_opt_chars { "0ABCQScefghijlmqtz"sv };
   static constexpr std::array<func, short_opt_chars.size()> short_opts {
+    do_null,
     do_aflag,
     do_bflag,
     do_cflag,
     do_qflag,
+    do_smart_case,
     do_count,
+    do_regexp,
+    do_file,
+    do_glob,
     do_hflag,
+    do_ignore_case,
+    do_threads,
     do_lflag,
+    do_max_count,
+    do_quiet,
+    do_type,
+    do_search_zip,
   };
 
   // Guaranteed to populate opts.argv0, even if an exception is thrown.
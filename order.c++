@@ -0,0 +1,104 @@
+#include "order.h"
+
+#include <string>
+#include <vector>
+
+#include "io.h"
+
+struct OrderedOutput::Node {
+  explicit Node(Node* parent): parent(parent) {}
+
+  Node* const parent;
+  std::vector<std::unique_ptr<Node>> children;
+  // Children before this one are written out, and gone.
+  size_t next = 0;
+  std::string block;
+  bool separate = false;
+  // Whether its own output is in; the cursor goes past it to its children.
+  bool done = false;
+  // Whether it has all its children.
+  bool closed = false;
+};
+
+OrderedOutput::OrderedOutput(Output& out)
+    : out(out), top(std::make_unique<Node>(nullptr)), cursor(top.get()) {
+  top->done = true;
+}
+
+OrderedOutput::~OrderedOutput() = default;
+
+OrderedOutput::Node* OrderedOutput::add(Node* parent) {
+  std::lock_guard lk(m);
+  return parent->children.emplace_back(std::make_unique<Node>(parent)).get();
+}
+
+void OrderedOutput::open(Node* node) {
+  std::lock_guard lk(m);
+  node->done = true;
+  advance();
+}
+
+void OrderedOutput::put(Node* node, std::string_view block, bool separate) {
+  std::lock_guard lk(m);
+  node->done = node->closed = true;
+  if (node == cursor) {
+    // Its turn already, so there's no need to keep it.
+    out.write(block, separate);
+  }
+  else {
+    node->block = block;
+    node->separate = separate;
+    held += block.size();
+  }
+  advance();
+}
+
+void OrderedOutput::finish(Node* node) {
+  std::lock_guard lk(m);
+  node->done = node->closed = true;
+  advance();
+}
+
+void OrderedOutput::add_worker() {
+  std::lock_guard lk(m);
+  ++workers;
+}
+
+void OrderedOutput::wait_turn(const Node* first) {
+  std::unique_lock lk(m);
+  if (held <= HELD_LIMIT) {
+    return;
+  }
+  ++waiting;
+  room.wait(lk, [&] {
+    return held <= HELD_LIMIT || cursor == first || waiting >= workers;
+  });
+  --waiting;
+}
+
+void OrderedOutput::advance() {
+  const auto was = cursor;
+  while (cursor && cursor->done) {
+    auto& node = *cursor;
+    if (!node.block.empty()) {
+      out.write(node.block, node.separate);
+      held -= node.block.size();
+      std::string().swap(node.block);
+    }
+    if (node.next < node.children.size()) {
+      cursor = node.children[node.next].get();
+      continue;
+    }
+    if (!node.closed) {
+      break;
+    }
+    // It's all out, children and all.
+    cursor = node.parent;
+    if (cursor) {
+      cursor->children[cursor->next++].reset();
+    }
+  }
+  if (cursor != was && waiting) {
+    room.notify_all();
+  }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string_view>
+
+class Output;
+
+// Writes search results in the order of the walk rather than in the order
+// they're found, for --sort.  The walk is a tree: the paths from the command
+// line are the root's children, a directory's entries are its children,
+// added in order as it's read, and each file is a leaf that leaves a block of
+// output, or none.  A block goes out as soon as everything before it in the
+// tree is in, so the first results go out about as soon as they would
+// anyway, and only those waiting on an earlier one are held back.
+class OrderedOutput {
+ public:
+  // Once the blocks held back come to this much, wait_turn() holds up
+  // workers until the ones in the way are done.
+  static constexpr size_t HELD_LIMIT = 32uz << 20;
+
+  struct Node;
+
+  explicit OrderedOutput(Output& out);
+  ~OrderedOutput();
+
+  OrderedOutput(const OrderedOutput&) = delete;
+  OrderedOutput& operator=(const OrderedOutput&) = delete;
+
+  // The parent of the paths from the command line, to finish() once they've
+  // all been added.
+  Node* root() const noexcept {
+    return top.get();
+  }
+
+  // Adds a last child to parent, which mustn't be finished.
+  Node* add(Node* parent);
+
+  // Says node has no output of its own, but children still to come, as a
+  // directory being read does; those can go out as they're done.
+  void open(Node* node);
+
+  // Gives node its output, with a blank line first if separate is set and
+  // it's not the first, as with Output::write().  node mustn't get any
+  // children, and mustn't be touched again.
+  void put(Node* node, std::string_view block, bool separate);
+
+  // Says node has no more children and no output other than what put() or
+  // they have, and that it mustn't be touched again.
+  void finish(Node* node);
+
+  // Counts a thread that may call wait_turn().
+  void add_worker();
+
+  // Called before a job whose first node is first starts on it, to wait while
+  // too much is held back, unless first is what's in the way or every other
+  // worker is waiting too.  Either way, the output isn't waiting on the job
+  // that's held up, so some other worker is getting on with it.
+  void wait_turn(const Node* first);
+
+ private:
+  // Writes whatever's ready, from the cursor on.
+  void advance();
+
+  Output& out;
+  std::mutex m;
+  const std::unique_ptr<Node> top;
+  // The first node not yet all written out, or null once the root is.
+  Node* cursor;
+  // The size of the blocks put() but not yet written.
+  size_t held = 0;
+  size_t workers = 0;
+  size_t waiting = 0;
+  std::condition_variable room;
+};
@@ -0,0 +1,396 @@
+#include "prefetch.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define GR_IO_URING 1
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+#ifdef GR_IO_URING
+
+namespace {
+
+// The user_data of a read, as opposed to an open, has this bit set; the rest
+// is the slot.
+constexpr uint64_t IS_READ = uint64_t(1) << 32;
+
+}   // namespace
+
+// A submission and a completion queue, mapped.  Only the owning thread
+// touches them, so it's only the kernel's ends of each that need acquire and
+// release.
+struct Prefetcher::Ring {
+  // Returns null if there's no io_uring to be had.
+  static std::unique_ptr<Ring> create(unsigned entries) {
+    io_uring_params p{};
+    const int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+      return nullptr;
+    }
+    auto ring = std::make_unique<Ring>(fd);
+    if (!ring->map(p)) {
+      return nullptr;
+    }
+    return ring;
+  }
+
+  explicit Ring(int fd): fd(fd) {}
+
+  ~Ring() {
+    if (sqes) {
+      munmap(sqes, sqes_len);
+    }
+    if (cq && cq != sq) {
+      munmap(cq, cq_len);
+    }
+    if (sq) {
+      munmap(sq, sq_len);
+    }
+    close(fd);
+  }
+
+  Ring(const Ring&) = delete;
+  Ring& operator=(const Ring&) = delete;
+
+  // Returns a cleared entry to fill in and then push().  There's always room,
+  // since no more than the ring holds are ever in flight.
+  io_uring_sqe& next() {
+    const auto tail = *sq_tail;
+    const auto i = tail & *sq_mask;
+    sq_array[i] = i;
+    std::memset(&sqes[i], 0, sizeof(sqes[i]));
+    return sqes[i];
+  }
+
+  void push() {
+    std::atomic_ref(*sq_tail).store(*sq_tail + 1, std::memory_order_release);
+    ++unsubmitted;
+  }
+
+  // Submits what's been pushed, and waits for min_complete completions.
+  // Returns false and sets errno on failure.
+  bool enter(unsigned min_complete) {
+    while (true) {
+      const auto n = syscall(__NR_io_uring_enter, fd, unsubmitted,
+                             min_complete,
+                             min_complete ? IORING_ENTER_GETEVENTS : 0,
+                             nullptr, 0);
+      if (n >= 0) {
+        unsubmitted -= n;
+        return true;
+      }
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        return false;
+      }
+    }
+  }
+
+  template <typename F>
+  void each_completion(F f) {
+    auto head = *cq_head;
+    const auto tail =
+        std::atomic_ref(*cq_tail).load(std::memory_order_acquire);
+    for (; head != tail; ++head) {
+      f(cqes[head & *cq_mask]);
+    }
+    std::atomic_ref(*cq_head).store(head, std::memory_order_release);
+  }
+
+ private:
+  bool map(const io_uring_params& p) {
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+      sq_len = cq_len = std::max(sq_len, cq_len);
+    }
+    sq = map(sq_len, IORING_OFF_SQ_RING);
+    if (!sq) {
+      return false;
+    }
+    cq = single ? sq : map(cq_len, IORING_OFF_CQ_RING);
+    if (!cq) {
+      return false;
+    }
+    sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(map(sqes_len, IORING_OFF_SQES));
+    if (!sqes) {
+      return false;
+    }
+    auto at = [](void* base, uint32_t off) {
+      return reinterpret_cast<unsigned*>(static_cast<char*>(base) + off);
+    };
+    sq_tail = at(sq, p.sq_off.tail);
+    sq_mask = at(sq, p.sq_off.ring_mask);
+    sq_array = at(sq, p.sq_off.array);
+    cq_head = at(cq, p.cq_off.head);
+    cq_tail = at(cq, p.cq_off.tail);
+    cq_mask = at(cq, p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(static_cast<char*>(cq)
+                                           + p.cq_off.cqes);
+    return true;
+  }
+
+  void* map(size_t len, off_t what) {
+    auto p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, what);
+    return p == MAP_FAILED ? nullptr : p;
+  }
+
+  const int fd;
+  void* sq = nullptr;
+  void* cq = nullptr;
+  io_uring_sqe* sqes = nullptr;
+  size_t sq_len = 0;
+  size_t cq_len = 0;
+  size_t sqes_len = 0;
+  unsigned* sq_tail = nullptr;
+  unsigned* sq_mask = nullptr;
+  unsigned* sq_array = nullptr;
+  unsigned* cq_head = nullptr;
+  unsigned* cq_tail = nullptr;
+  unsigned* cq_mask = nullptr;
+  io_uring_cqe* cqes = nullptr;
+  unsigned unsubmitted = 0;
+};
+
+#else
+
+// Stands in where there's no io_uring: create() always fails, so start()
+// never starts anything and nothing else gets called.
+struct Prefetcher::Ring {
+  static std::unique_ptr<Ring> create(unsigned) {
+    return nullptr;
+  }
+};
+
+#endif
+
+Prefetcher::Handoff::Handoff(Handoff&& other) noexcept
+    : fd(other.take()), head(std::move(other.head)) {}
+
+Prefetcher::Handoff& Prefetcher::Handoff::operator=(Handoff&& other) noexcept {
+  if (this != &other) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    fd = other.take();
+    head = std::move(other.head);
+  }
+  return *this;
+}
+
+Prefetcher::Handoff::~Handoff() {
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+Prefetcher::Prefetcher() = default;
+
+Prefetcher::~Prefetcher() {
+  finish();
+}
+
+bool Prefetcher::start(int at, const std::string& names, size_t first) {
+  if (unavailable) {
+    return false;
+  }
+  if (!ring) {
+    ring = Ring::create(FILES);
+    if (!ring) {
+      unavailable = true;
+      return false;
+    }
+    heads = std::make_unique_for_overwrite<char[]>(FILES * HEAD);
+    slots.resize(FILES);
+  }
+  this->at = at;
+  this->names = &names;
+  pos = 0;
+  for (auto i = 0uz; i < first && pos < names.size(); ++i) {
+    pos += std::strlen(names.c_str() + pos) + 1;
+  }
+  this->first = started = first;
+  top_up(first);
+  return !unavailable;
+}
+
+Prefetcher::File Prefetcher::take(size_t n) {
+  if (n >= first) {
+    top_up(n);
+  }
+  if (n < first || n >= started) {
+    return {-1, {}};
+  }
+  auto& slot = slots[n % FILES];
+  while (!slot.read) {
+    reap(true);
+  }
+  if (slot.fd < 0) {
+    return {-1, {}};
+  }
+  slot.taken = true;
+  return {slot.fd, {heads.get() + n % FILES * HEAD, slot.size}};
+}
+
+std::vector<Prefetcher::Handoff> Prefetcher::release(size_t n) {
+  std::vector<Handoff> files;
+  for (auto i = std::max(n, first); i < started; ++i) {
+    auto& slot = slots[i % FILES];
+    while (!slot.read) {
+      reap(true);
+    }
+    auto& f = files.emplace_back();
+    if (slot.fd >= 0 && !slot.taken) {
+      f.fd = slot.fd;
+      f.head.assign(heads.get() + i % FILES * HEAD, slot.size);
+      slot.taken = true;
+    }
+  }
+  names = nullptr;
+  return files;
+}
+
+void Prefetcher::finish() noexcept {
+  draining = true;
+  names = nullptr;
+  try {
+    while (in_flight) {
+      reap(true);
+    }
+  }
+  catch (const std::system_error&) {
+    // The ring is broken, and the kernel may yet write to the heads, so leave
+    // them be.
+    (void)heads.release();
+    ring.reset();
+    in_flight = 0;
+    unavailable = true;
+  }
+  for (auto& slot: slots) {
+    if (!slot.taken && slot.fd >= 0) {
+      close(slot.fd);
+    }
+    slot = Slot();
+  }
+  if (!ring) {
+    slots.clear();
+  }
+  first = started = 0;
+  draining = false;
+}
+
+void Prefetcher::top_up(size_t n) {
+#ifdef GR_IO_URING
+  const auto before = started;
+  while (names && !unavailable && pos < names->size()
+         && started < n + FILES) {
+    auto& slot = slots[started % FILES];
+    // What was there is from before n, so it's been taken or passed over.
+    clear(slot);
+    const char* const name = names->c_str() + pos;
+    auto& sqe = ring->next();
+    sqe.opcode = IORING_OP_OPENAT;
+    sqe.fd = at;
+    sqe.addr = reinterpret_cast<uintptr_t>(name);
+    sqe.open_flags = O_RDONLY | O_CLOEXEC;
+    sqe.user_data = started % FILES;
+    ring->push();
+    slot.read = false;
+    ++in_flight;
+    ++started;
+    pos += std::strlen(name) + 1;
+  }
+  if (started != before && !ring->enter(0)) {
+    if (before == first) {
+      // Nothing went in, so there's nothing to wait for.
+      ring.reset();
+      for (auto& slot: slots) {
+        slot = Slot();
+      }
+      slots.clear();
+      in_flight = 0;
+      started = first;
+      unavailable = true;
+      return;
+    }
+    throw std::system_error(errno, std::generic_category(),
+                            "io_uring_enter");
+  }
+#else
+  (void)n;
+#endif
+}
+
+void Prefetcher::clear(Slot& slot) {
+  while (!slot.read) {
+    reap(true);
+  }
+  if (!slot.taken && slot.fd >= 0) {
+    close(slot.fd);
+  }
+  slot = Slot();
+}
+
+void Prefetcher::submit_read(size_t n) {
+#ifdef GR_IO_URING
+  auto& sqe = ring->next();
+  sqe.opcode = IORING_OP_READ;
+  sqe.fd = slots[n].fd;
+  sqe.addr = reinterpret_cast<uintptr_t>(heads.get() + n * HEAD);
+  sqe.len = HEAD;
+  sqe.off = 0;
+  sqe.user_data = n | IS_READ;
+  ring->push();
+  ++in_flight;
+#else
+  (void)n;
+#endif
+}
+
+void Prefetcher::reap(bool wait) {
+#ifdef GR_IO_URING
+  if (!ring->enter(wait)) {
+    throw std::system_error(errno, std::generic_category(),
+                            "io_uring_enter");
+  }
+  ring->each_completion([this](const io_uring_cqe& cqe) {
+    --in_flight;
+    auto& slot = slots[cqe.user_data & ~IS_READ];
+    if (cqe.user_data & IS_READ) {
+      // A failed read just leaves it to the caller to read.
+      slot.size = cqe.res > 0 ? cqe.res : 0;
+      slot.read = true;
+    }
+    else if (cqe.res < 0) {
+      if (cqe.res == -EINVAL) {
+        // Too old a kernel for these ops.
+        unavailable = true;
+      }
+      slot.read = true;
+    }
+    else {
+      slot.fd = cqe.res;
+      if (draining) {
+        slot.read = true;
+      }
+      else {
+        submit_read(&slot - slots.data());
+      }
+    }
+  });
+#else
+  (void)wait;
+#endif
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Opens a batch of files and reads the start of each through io_uring, so
+// that a worker has all of their I/O in flight at once rather than waiting
+// on each file in turn.  That's what matters on a cold cache or a network
+// filesystem, where a search spends most of its time waiting on opens and
+// reads.  Where there's no io_uring, start() just says no and files get
+// opened and read as usual.
+class Prefetcher {
+ public:
+  // At most this many files are in flight at once.
+  static constexpr size_t FILES = 64;
+  // How much of each file gets read ahead of time.
+  static constexpr size_t HEAD = 32uz << 10;
+
+  Prefetcher();
+  ~Prefetcher();
+
+  Prefetcher(const Prefetcher&) = delete;
+  Prefetcher& operator=(const Prefetcher&) = delete;
+
+  // Starts opening the NUL-separated names from number `first` on, relative
+  // to the directory at, and reading up to HEAD of each, keeping FILES of
+  // them in flight as take() hands them out.  names must last until
+  // finish(), and nothing past its end is started if it shrinks meanwhile.
+  // Returns false if io_uring can't be used.  Whatever it starts must be
+  // finish()ed before it's started again.
+  bool start(int at, const std::string& names, size_t first = 0);
+
+  struct File {
+    // Or -1 if it couldn't be opened this way, so the caller should open it
+    // as usual and see why.
+    int fd;
+    // What was read of the start of the file; good until the next take().
+    std::string_view head;
+  };
+
+  // Waits for the nth of the names and hands over its fd, starting the next
+  // in the place of those before it.  Throws std::system_error if io_uring
+  // itself fails.
+  File take(size_t n);
+
+  // A started file handed to another job, with its head copied out.  Owns
+  // the fd until it's taken, so a job that's dropped unrun doesn't leak it.
+  struct Handoff {
+    Handoff() = default;
+    Handoff(Handoff&& other) noexcept;
+    Handoff& operator=(Handoff&& other) noexcept;
+    ~Handoff();
+
+    // Hands over the fd, or -1 if it couldn't be opened.
+    int take() noexcept {
+      return std::exchange(fd, -1);
+    }
+
+    int fd = -1;
+    std::string head;
+  };
+
+  // Waits for the files from the nth on that were started and hands them
+  // over, in order, for the job that gets those names.  Starts no more.
+  std::vector<Handoff> release(size_t n);
+
+  // Waits for whatever is still in flight, and closes the files not taken.
+  void finish() noexcept;
+
+ private:
+  struct Ring;
+  struct Slot {
+    int fd = -1;
+    size_t size = 0;
+    // Whether it's done, one way or another.
+    bool read = true;
+    bool taken = false;
+  };
+
+  // Starts names until there are FILES in flight from the nth on.
+  void top_up(size_t n);
+  // Waits for the slot to be done with, and closes its file if it wasn't
+  // taken.
+  void clear(Slot& slot);
+  void submit_read(size_t n);
+  // Submits what's queued and handles completions, waiting for at least one
+  // if wait is set.
+  void reap(bool wait);
+
+  std::unique_ptr<Ring> ring;
+  // Set once io_uring turns out not to work, so it isn't tried again.
+  bool unavailable = false;
+  std::unique_ptr<char[]> heads;
+  // File n of the names is in slot n % FILES, while first <= n < started.
+  std::vector<Slot> slots;
+  int at = -1;
+  const std::string* names = nullptr;
+  // Where the next name to start is in names.
+  size_t pos = 0;
+  size_t first = 0;
+  size_t started = 0;
+  size_t in_flight = 0;
+  // Set while finishing, when there's no point reading anything more.
+  bool draining = false;
+};
@@ -0,0 +1,68 @@
+#include "stats.h"
+
+#include <chrono>
+#include <format>
+#include <iterator>
+#include <string_view>
+#include <utility>
+
+namespace {
+
+constexpr std::pair<std::string_view, uint64_t Stats::*> FIELDS[] = {
+  {"dirs", &Stats::dirs},
+  {"files", &Stats::files},
+  {"binary_files", &Stats::binary_files},
+  {"matched_files", &Stats::matched_files},
+  {"matched_lines", &Stats::matched_lines},
+  {"bytes_read", &Stats::bytes_read},
+  {"bytes_scanned", &Stats::bytes_scanned},
+  {"cache_hits", &Stats::cache_hits},
+  {"cache_misses", &Stats::cache_misses},
+  {"readdir_ns", &Stats::readdir_ns},
+  {"stat_ns", &Stats::stat_ns},
+  {"read_ns", &Stats::read_ns},
+  {"regex_ns", &Stats::regex_ns},
+  {"output_ns", &Stats::output_ns},
+  {"wait_ns", &Stats::wait_ns},
+  {"peak_jobs", &Stats::peak_jobs},
+  {"wall_ns", &Stats::wall_ns},
+};
+
+}   // namespace
+
+Stats& Stats::operator+=(const Stats& other) noexcept {
+  for (const auto& [_, field]: FIELDS) {
+    this->*field += other.*field;
+  }
+  return *this;
+}
+
+std::string Stats::format(bool json) const {
+  std::string ret;
+  auto out = std::back_inserter(ret);
+  if (json) {
+    ret += '{';
+    for (const auto& [name, field]: FIELDS) {
+      std::format_to(out, "{}\"{}\":{}", ret.size() > 1 ? "," : "", name,
+                     this->*field);
+    }
+    ret += "}\n";
+    return ret;
+  }
+  for (const auto& [name, field]: FIELDS) {
+    if (name.ends_with("_ns")) {
+      std::format_to(out, "{:<16}{:.3f} ms\n",
+                     name.substr(0, name.size() - 3),
+                     (this->*field) / 1e6);
+    }
+    else {
+      std::format_to(out, "{:<16}{}\n", name, this->*field);
+    }
+  }
+  return ret;
+}
+
+uint64_t stat_clock() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// What --stats reports.  Each worker counts into its own, without locks or
+// atomics, and main adds them up once the workers are done; the times are
+// summed over the workers.
+struct Stats {
+  uint64_t dirs = 0;
+  uint64_t files = 0;
+  uint64_t binary_files = 0;
+  uint64_t matched_files = 0;
+  uint64_t matched_lines = 0;
+  uint64_t bytes_read = 0;
+  uint64_t bytes_scanned = 0;
+  // With --cache, files it had an answer for, and files it hadn't.
+  uint64_t cache_hits = 0;
+  uint64_t cache_misses = 0;
+  // Nanoseconds, only counted with --stats.
+  uint64_t readdir_ns = 0;
+  uint64_t stat_ns = 0;
+  uint64_t read_ns = 0;
+  uint64_t regex_ns = 0;
+  uint64_t output_ns = 0;
+  // Filled in by main rather than by the workers.
+  uint64_t wait_ns = 0;
+  uint64_t peak_jobs = 0;
+  uint64_t wall_ns = 0;
+
+  Stats& operator+=(const Stats& other) noexcept;
+
+  // One name and value per line, or a JSON object on one line.
+  std::string format(bool json) const;
+};
+
+// A monotonic clock in nanoseconds.
+uint64_t stat_clock() noexcept;
+
+// Adds the time from construction to destruction to *counter, unless
+// counter is null.
+class StatTimer {
+ public:
+  explicit StatTimer(uint64_t* counter) noexcept
+      : counter(counter), start(counter ? stat_clock() : 0) {}
+
+  ~StatTimer() {
+    if (counter) {
+      *counter += stat_clock() - start;
+    }
+  }
+
+  StatTimer(const StatTimer&) = delete;
+  StatTimer& operator=(const StatTimer&) = delete;
+
+ private:
+  uint64_t* const counter;
+  const uint64_t start;
+};
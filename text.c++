@@ -0,0 +1,79 @@
+#include "text.h"
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+
+namespace {
+
+// Formats that can go on a while before their first NUL, if they have one at
+// all.  Those that start with one don't need to be here.
+constexpr std::string_view MAGIC[] = {
+  "!<arch>\n",            // ar, so .a and .deb
+  "\x04\x22\x4d\x18",     // lz4
+  "\x1f\x8b",             // gzip
+  "\x28\xb5\x2f\xfd",     // zstd
+  "\x7f" "ELF",
+  "\x89PNG\r\n\x1a\n",
+  "\xca\xfe\xba\xbe",     // Java class, Mach-O universal
+  "\xce\xfa\xed\xfe",     // Mach-O
+  "\xcf\xfa\xed\xfe",
+  "\xfd" "7zXZ",          // xz
+  "\xff\xd8\xff",         // JPEG
+  "%PDF-",
+  "7z\xbc\xaf\x27\x1c",
+  "GIF87a",
+  "GIF89a",
+  "OggS",
+  "PK\x03\x04",           // zip, jar, docx, ...
+  "Rar!\x1a\x07",
+  "SQLite format 3",
+  "wOF2",
+  "wOFF",
+};
+
+}   // namespace
+
+bool is_binary(std::string_view buf) {
+  if (!buf.size()) {
+    return false;
+  }
+  if (buf.starts_with("\xef\xbb\xbf")) {
+    // UTF-8 BOM
+    return false;
+  }
+  for (const auto magic: MAGIC) {
+    if (buf.starts_with(magic)) {
+      return true;
+    }
+  }
+  return has_nul(buf);
+}
+
+std::string_view truncate_span(std::string_view view, size_t end,
+                               bool long_lines) {
+  if (long_lines || end <= MAX_LINE) {
+    return std::string_view(view.begin(), end);
+  }
+  std::string_view ret(view.begin(), MAX_LINE);
+  // try to truncate to the nearest UTF-8 code point
+  auto it = std::rbegin(ret);
+  int i = 0;
+  // scan until we're at something that is not a utf8-tail
+  for (; i < 4 && (*it & 0xc0) == 0x80; ++it, ++i) { }
+  static constexpr std::array<std::pair<uint8_t, uint8_t>, 5> mask_check {{
+    {0x80, 0},      // 1 from end: must be ASCII
+    {0xe0, 0xc0},   // 2 from end: ok if it's a 2-byte code point
+    {0xf0, 0xe0},   // 3 from end
+    {0xf8, 0xf0},   // 4 from end
+    {0, 0},         // 5? TODO(display): not valid utf8; passthru
+  }};
+  assert(i < 5);
+  auto [mask, check] = mask_check[i];
+  if ((*it & mask) != check) {
+    ret.remove_suffix(i + 1);
+  }
+  return ret;
+}
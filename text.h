@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+// Lines longer than this are cut short when printed, unless --long-lines.
+inline constexpr size_t MAX_LINE = 2048;
+
+// How much of the start of a file gets looked at before searching it.
+inline constexpr size_t BINARY_HEAD = 512;
+
+// Whether buf, the start of a file, looks like it isn't text: it starts with
+// the magic number of a binary format, or has a NUL byte.
+bool is_binary(std::string_view buf);
+
+// Whether buf has a NUL byte, which text never does.
+inline bool has_nul(std::string_view buf) {
+  // memchr is vectorized in any libc worth the name.
+  return buf.find('\0') != buf.npos;
+}
+
+// Returns the first end bytes of view, or unless long_lines is set, about
+// MAX_LINE of them, cut at a UTF-8 code point boundary.
+std::string_view truncate_span(std::string_view view, size_t end,
+                               bool long_lines);
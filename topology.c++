@@ -0,0 +1,145 @@
+#include "topology.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+#ifdef __linux__
+
+namespace {
+
+bool allowed_cpus(cpu_set_t& set) {
+  CPU_ZERO(&set);
+  return !sched_getaffinity(0, sizeof(set), &set);
+}
+
+// Reads a list like 0-3,8 from sysfs, or gives nothing if it isn't there.
+std::vector<int> read_cpu_list(const std::string& path) {
+  std::vector<int> cpus;
+  std::ifstream in(path);
+  std::string line;
+  if (!std::getline(in, line)) {
+    return cpus;
+  }
+  for (std::string_view rest = line; rest.size(); ) {
+    const auto comma = std::min(rest.find(','), rest.size());
+    const auto range = rest.substr(0, comma);
+    rest.remove_prefix(std::min(comma + 1, rest.size()));
+    const auto end = range.data() + range.size();
+    int lo;
+    auto [p, ec] = std::from_chars(range.data(), end, lo);
+    if (ec != std::errc()) {
+      continue;
+    }
+    auto hi = lo;
+    if (p != end && *p == '-') {
+      std::from_chars(p + 1, end, hi);
+    }
+    for (auto cpu = lo; cpu <= hi; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+}   // namespace
+
+size_t Topology::available_cpus() {
+  cpu_set_t set;
+  if (allowed_cpus(set) && CPU_COUNT(&set)) {
+    return CPU_COUNT(&set);
+  }
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+bool Topology::pin(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  // 0 is the calling thread, not the whole process.
+  return !sched_setaffinity(0, sizeof(set), &set);
+}
+
+Topology::Topology() {
+  cpu_set_t set;
+  if (!allowed_cpus(set)) {
+    return;
+  }
+  const std::string nodes_dir = "/sys/devices/system/node";
+  std::map<int, unsigned> node_of;
+  if (auto d = opendir(nodes_dir.c_str())) {
+    while (auto e = readdir(d)) {
+      const std::string_view name = e->d_name;
+      unsigned node;
+      if (!name.starts_with("node")
+          || std::from_chars(name.data() + 4, name.data() + name.size(),
+                             node).ec != std::errc()) {
+        continue;
+      }
+      const auto path = nodes_dir + '/' + e->d_name + "/cpulist";
+      for (auto cpu: read_cpu_list(path)) {
+        node_of[cpu] = node;
+      }
+    }
+    closedir(d);
+  }
+  // In each node, the first of each core's hardware threads that's allowed,
+  // and then the rest.
+  std::map<unsigned, std::pair<std::vector<Cpu>, std::vector<Cpu>>> by_node;
+  auto count = 0uz;
+  for (auto cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (!CPU_ISSET(cpu, &set)) {
+      continue;
+    }
+    const auto siblings = read_cpu_list(
+        "/sys/devices/system/cpu/cpu" + std::to_string(cpu)
+        + "/topology/thread_siblings_list");
+    const bool first = std::ranges::none_of(siblings, [&](int sibling) {
+      return sibling < cpu && sibling < CPU_SETSIZE
+          && CPU_ISSET(sibling, &set);
+    });
+    const auto it = node_of.find(cpu);
+    const auto node = it == node_of.end() ? 0 : it->second;
+    auto& [firsts, rest] = by_node[node];
+    (first ? firsts : rest).push_back({cpu, node});
+    ++count;
+  }
+  std::vector<std::vector<Cpu>> nodes;
+  for (auto& [node, cpus]: by_node) {
+    auto& [firsts, rest] = cpus;
+    firsts.insert(firsts.end(), rest.begin(), rest.end());
+    nodes.push_back(std::move(firsts));
+  }
+  // Dealt out a node at a time.
+  for (auto i = 0uz; order.size() < count; ++i) {
+    for (const auto& cpus: nodes) {
+      if (i < cpus.size()) {
+        order.push_back(cpus[i]);
+      }
+    }
+  }
+}
+
+#else
+
+size_t Topology::available_cpus() {
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+bool Topology::pin(int) {
+  return false;
+}
+
+Topology::Topology() = default;
+
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// The CPUs this process may run on, as --pin-threads hands them out to
+// workers: spread evenly over the NUMA nodes, so that each node's memory and
+// caches get used, and within a node over separate cores before any core
+// gets a second hardware thread.
+class Topology {
+ public:
+  struct Cpu {
+    int id;
+    unsigned node;
+  };
+
+  // How many CPUs this process may run on, which is how many workers there
+  // are by default.
+  static size_t available_cpus();
+
+  // Pins the calling thread to cpu.  Returns false if it can't be.
+  static bool pin(int cpu);
+
+  // Reads the nodes and cores from sysfs.  Where there's no telling, the
+  // CPUs are all on node 0 and share no cores, and where there's no pinning,
+  // there are none at all.
+  Topology();
+
+  bool empty() const noexcept {
+    return order.empty();
+  }
+
+  // Where worker number `worker` goes, going round again if there are more
+  // workers than CPUs.  Mustn't be empty().
+  const Cpu& cpu_for(size_t worker) const noexcept {
+    return order[worker % order.size()];
+  }
+
+ private:
+  std::vector<Cpu> order;
+};
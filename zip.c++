@@ -0,0 +1,213 @@
+#include "zip.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <system_error>
+
+#ifdef GR_GZIP
+#include <zlib.h>
+#endif
+#ifdef GR_XZ
+#include <lzma.h>
+#endif
+#ifdef GR_ZSTD
+#include <zstd.h>
+#endif
+
+using namespace std::string_view_literals;
+
+namespace {
+
+[[noreturn]] [[maybe_unused]] void throw_corrupt(const std::string& what) {
+  throw std::system_error(std::make_error_code(std::errc::io_error), what);
+}
+
+// Drops the zero padding after a stream, and returns whether there's another
+// to start on.
+[[maybe_unused]] bool skip_padding(std::string_view& in) {
+  in.remove_prefix(std::min(in.find_first_not_of('\0'), in.size()));
+  return !in.empty();
+}
+
+#ifdef GR_GZIP
+
+constexpr auto GZIP_MAGIC = "\x1f\x8b"sv;
+
+class GzipDecoder : public Decoder {
+ public:
+  GzipDecoder() {
+    // Just gzip's header, not zlib's.
+    if (inflateInit2(&z, 15 + 16) != Z_OK) {
+      throw std::bad_alloc();
+    }
+  }
+
+  ~GzipDecoder() override {
+    inflateEnd(&z);
+  }
+
+  size_t decode(std::string_view& in, char* out, size_t n) override {
+    if (garbage) {
+      in = {};
+      return 0;
+    }
+    if (ended) {
+      if (!skip_padding(in)) {
+        return 0;
+      }
+      inflateReset(&z);
+      ended = false;
+      magic_seen = 0;
+    }
+    // A stream after the first has to start with the magic number, which
+    // may come split between reads, or it's garbage that gzip(1) would warn
+    // about and ignore.
+    for (auto i = 0uz; magic_seen < GZIP_MAGIC.size() && i < in.size();
+         ++i, ++magic_seen) {
+      if (in[i] != GZIP_MAGIC[magic_seen]) {
+        garbage = ended = true;
+        in = {};
+        return 0;
+      }
+    }
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    z.avail_in = std::min<size_t>(in.size(), UINT_MAX);
+    z.next_out = reinterpret_cast<Bytef*>(out);
+    z.avail_out = std::min<size_t>(n, UINT_MAX);
+    const auto avail_in = z.avail_in;
+    const auto avail_out = z.avail_out;
+    const int ret = inflate(&z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      ended = true;
+    }
+    else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      throw_corrupt(std::string("gzip: ") + (z.msg ? z.msg : "bad data"));
+    }
+    in.remove_prefix(avail_in - z.avail_in);
+    return avail_out - z.avail_out;
+  }
+
+ private:
+  z_stream z{};
+  // How much of the current stream's magic number has been checked; detect()
+  // saw the first one's.
+  size_t magic_seen = GZIP_MAGIC.size();
+};
+
+#endif
+
+#ifdef GR_XZ
+
+class XzDecoder : public Decoder {
+ public:
+  XzDecoder() {
+    init();
+  }
+
+  ~XzDecoder() override {
+    lzma_end(&s);
+  }
+
+  size_t decode(std::string_view& in, char* out, size_t n) override {
+    if (ended) {
+      if (!skip_padding(in)) {
+        return 0;
+      }
+      // There's no resetting a decoder, only making a new one.
+      lzma_end(&s);
+      init();
+      ended = false;
+    }
+    s.next_in = reinterpret_cast<const uint8_t*>(in.data());
+    s.avail_in = in.size();
+    s.next_out = reinterpret_cast<uint8_t*>(out);
+    s.avail_out = n;
+    const auto ret = lzma_code(&s, LZMA_RUN);
+    if (ret == LZMA_STREAM_END) {
+      ended = true;
+    }
+    else if (ret == LZMA_MEM_ERROR) {
+      throw std::bad_alloc();
+    }
+    else if (ret != LZMA_OK && ret != LZMA_BUF_ERROR) {
+      throw_corrupt(ret == LZMA_OPTIONS_ERROR ? "xz: unsupported options"
+                                              : "xz: corrupt data");
+    }
+    in.remove_prefix(in.size() - s.avail_in);
+    return n - s.avail_out;
+  }
+
+ private:
+  void init() {
+    s = LZMA_STREAM_INIT;
+    if (lzma_stream_decoder(&s, UINT64_MAX, 0) != LZMA_OK) {
+      throw std::bad_alloc();
+    }
+  }
+
+  lzma_stream s = LZMA_STREAM_INIT;
+};
+
+#endif
+
+#ifdef GR_ZSTD
+
+class ZstdDecoder : public Decoder {
+ public:
+  ZstdDecoder(): d(ZSTD_createDStream()) {
+    if (!d) {
+      throw std::bad_alloc();
+    }
+  }
+
+  ~ZstdDecoder() override {
+    ZSTD_freeDStream(d);
+  }
+
+  size_t decode(std::string_view& in, char* out, size_t n) override {
+    // One frame just runs on into the next.
+    if (ended && !skip_padding(in)) {
+      return 0;
+    }
+    ZSTD_inBuffer from{in.data(), in.size(), 0};
+    ZSTD_outBuffer to{out, n, 0};
+    const auto ret = ZSTD_decompressStream(d, &to, &from);
+    if (ZSTD_isError(ret)) {
+      throw_corrupt(std::string("zstd: ") + ZSTD_getErrorName(ret));
+    }
+    // Or it has more of the frame to come.
+    ended = !ret;
+    in.remove_prefix(from.pos);
+    return to.pos;
+  }
+
+ private:
+  ZSTD_DStream* const d;
+};
+
+#endif
+
+}   // namespace
+
+std::unique_ptr<Decoder> Decoder::detect(std::string_view head) {
+#ifdef GR_GZIP
+  if (head.starts_with(GZIP_MAGIC)) {
+    return std::make_unique<GzipDecoder>();
+  }
+#endif
+#ifdef GR_XZ
+  if (head.starts_with("\xfd" "7zXZ\0"sv)) {
+    return std::make_unique<XzDecoder>();
+  }
+#endif
+#ifdef GR_ZSTD
+  if (head.starts_with("\x28\xb5\x2f\xfd"sv)) {
+    return std::make_unique<ZstdDecoder>();
+  }
+#endif
+  (void)head;
+  return nullptr;
+}
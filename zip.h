@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+// Decompresses a gzip, xz or zstd file as it's read, for -z.  Which of those
+// it knows depends on the libraries it was built with: see ZIP_FLAGS in the
+// Makefile.  It only ever transforms what it's given, so that FileContents
+// can read the file however it reads any other.
+class Decoder {
+ public:
+  // How much of the start of a file detect() wants to see.
+  static constexpr size_t MAGIC_SIZE = 6;
+
+  // Returns a decoder for the format whose magic number head starts with, or
+  // null if it's none of them.
+  static std::unique_ptr<Decoder> detect(std::string_view head);
+
+  virtual ~Decoder() = default;
+
+  // Decompresses what it can of in into the n bytes at out, dropping from in
+  // what it's used, and returns how much it wrote.  A file may hold several
+  // streams one after the other, as `cat a.gz b.gz` does; the zero padding
+  // some tools add after the last is skipped, and so, as gzip(1) does, is
+  // whatever follows a gzip stream that isn't another.  Throws
+  // std::system_error if the data is corrupt.
+  virtual size_t decode(std::string_view& in, char* out, size_t n) = 0;
+
+  // Whether the input so far ends a whole stream, so the file may end here
+  // without having been cut short.
+  bool at_end() const noexcept {
+    return ended;
+  }
+
+  // Whether it skipped data after the last stream that wasn't padding.
+  bool skipped_garbage() const noexcept {
+    return garbage;
+  }
+
+ protected:
+  bool ended = false;
+  bool garbage = false;
+};